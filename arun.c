@@ -1,10 +1,19 @@
+#define _GNU_SOURCE
 #include <X11/Xutil.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
-#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 
 #include <xcb/xcb.h>
 #include <xcb/randr.h>
@@ -15,15 +24,12 @@
 #include <X11/keysym.h>
 #include <xcb/xproto.h>
 
+#include "bins.h"
+#include "prefetch.h"
 #include "config.h"
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-
-#define MAX_BINS_SIZE 16384
-
-#define MAX_INPUT_SIZE 257
 #define VALUE_LIST_SIZE 32
+#define TRACE_BUCKETS 24
 
 typedef struct {
     uint16_t width;
@@ -35,16 +41,29 @@ typedef struct {
     size_t rrange_e;
 } input_bar_t;
 
+enum { FILL_INPUT, FILL_BIN, FILL_SELECTED, FILL_CURSOR, FILL_LAST };
+
 typedef struct {
-    char *all[MAX_BINS_SIZE];
-    size_t top;
-    const char *drawable[MAX_BINS_SIZE];
-    size_t dtop;
-    size_t cursor;
-    size_t prevcursor;
-    size_t rrange_s;
-    size_t rrange_e;
-} bins_t;
+    XftColor *color;
+    int x;
+    int y;
+    const char *text;
+    int len;
+} frame_text_t;
+
+/*
+ * One frame worth of drawing. Rectangles are batched per GC and everything
+ * is rendered into the back buffer, then the damaged rows are copied to
+ * the window with a single flush.
+ */
+typedef struct {
+    xcb_rectangle_t fills[FILL_LAST][COMPLETIONS_NUMBER + 2];
+    size_t nfills[FILL_LAST];
+    frame_text_t texts[COMPLETIONS_NUMBER + 2];
+    size_t ntexts;
+    xcb_rectangle_t damage[COMPLETIONS_NUMBER + 2];
+    size_t ndamage;
+} frame_t;
 
 static int mon_x;
 static int mon_y;
@@ -63,7 +82,16 @@ static xcb_generic_event_t *ev;
 
 static xcb_get_input_focus_reply_t *last_focus;
 
+static bool daemon_mode;
+static bool dmenu_mode;
+static bool visible;
+static int listen_fd = -1;
+static int client_fd = -1;
+static struct sockaddr_un daemon_addr;
+
 static xcb_window_t wid;
+static xcb_pixmap_t back_buffer;
+static frame_t frame;
 static int window_width;
 static int window_height;
 
@@ -71,8 +99,10 @@ static input_bar_t input = {0};
 static xcb_gcontext_t input_bar_gc;
 static xcb_gcontext_t cursor_gc;
 
-static bins_t bins;
-static bool parse_bins;
+static FILE *trace_file;
+static uint64_t trace_t0;
+static uint64_t trace_shown;
+static uint32_t trace_hist[TRACE_BUCKETS];
 static xcb_gcontext_t bin_gc;
 static xcb_gcontext_t selected_gc;
 
@@ -85,10 +115,72 @@ static XftColor selected_font_color;
 static uint32_t value_mask;
 static uint32_t value_list[VALUE_LIST_SIZE];
 
-static void die(const char *msg)
+static uint64_t trace_now(void)
+{
+    return trace_file ? now_ns() : 0;
+}
+
+/* ARUN_TRACE names a file, or - for stderr, that gets one JSON object per line. */
+static void trace_open(void)
+{
+    const char *path = getenv("ARUN_TRACE");
+    if (!path || !*path) return;
+
+    trace_file = strcmp(path, "-") == 0 ? stderr : fopen(path, "we");
+    if (!trace_file) {
+        perror(path);
+        return;
+    }
+    setvbuf(trace_file, NULL, _IOLBF, 0);
+    trace_t0 = trace_now();
+}
+
+static void trace_span(const char *phase, uint64_t start, uint64_t end)
+{
+    if (!trace_file) return;
+
+    fprintf(trace_file, "{\"phase\":\"%s\",\"at_us\":%.1f,\"dur_us\":%.1f}\n",
+            phase, (start - trace_t0) / 1e3, (end - start) / 1e3);
+}
+
+static void trace_phase(const char *phase, uint64_t start)
+{
+    trace_span(phase, start, trace_now());
+}
+
+/* One line per burst of keys: time in handle_key_press(), in draw_bins() and presenting the frame. */
+static void trace_keys(int keys, uint64_t handled, uint64_t start, uint64_t drawn, uint64_t end)
+{
+    if (!trace_file) return;
+
+    uint64_t total = (handled + end - start) / 1000;
+    int bucket = 0;
+    while (bucket + 1 < TRACE_BUCKETS && (1ull << bucket) <= total) bucket++;
+    trace_hist[bucket]++;
+
+    fprintf(trace_file, "{\"keys\":%d,\"at_us\":%.1f,\"handle_us\":%.1f,\"filter_us\":%.1f,\"render_us\":%.1f}\n",
+            keys, (start - trace_t0) / 1e3, handled / 1e3, (drawn - start) / 1e3, (end - drawn) / 1e3);
+}
+
+/* Bucket i counts bursts that took less than 2^i us, the last one everything slower. */
+static void trace_close(void)
 {
-    fprintf(stderr, "%s", msg);
-    exit(1);
+    if (!trace_file) return;
+
+    fprintf(trace_file, "{\"histogram\":\"keys\",\"lt_us\":[");
+    for (int i = 0; i < TRACE_BUCKETS; ++i) {
+        if (i + 1 < TRACE_BUCKETS) {
+            fprintf(trace_file, "%s%llu", i ? "," : "", 1ull << i);
+        } else {
+            fprintf(trace_file, ",null");
+        }
+    }
+    fprintf(trace_file, "],\"count\":[");
+    for (int i = 0; i < TRACE_BUCKETS; ++i) {
+        fprintf(trace_file, "%s%u", i ? "," : "", trace_hist[i]);
+    }
+    fprintf(trace_file, "]}\n");
+    fflush(trace_file);
 }
 
 static void cleanup(void)
@@ -96,162 +188,291 @@ static void cleanup(void)
     if (last_focus) {
         xcb_set_input_focus(c, XCB_INPUT_FOCUS_POINTER_ROOT, last_focus->focus, XCB_CURRENT_TIME);
     }
-    for (size_t i = 0; i < MAX_BINS_SIZE; ++i) {
-        free(bins.all[i]);
-    }
+    bins_cleanup();
     XftColorFree(dpy, visual, cmap, &input_font_color);
     XftColorFree(dpy, visual, cmap, &bin_font_color);
     XftColorFree(dpy, visual, cmap, &selected_font_color);
     XftDrawDestroy(font_draw);
+    xcb_free_pixmap(c, back_buffer);
     xcb_ungrab_button(c, XCB_BUTTON_INDEX_ANY, root, XCB_MOD_MASK_ANY);
     xcb_destroy_window(c, wid);
     XCloseDisplay(dpy);
+    if (client_fd >= 0) close(client_fd);
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(daemon_addr.sun_path);
+    }
+    trace_close();
 }
 
-static void run_command(void)
+static void hide(void)
 {
-    char *selected = strdup(bins.drawable[bins.cursor]);
-    pid_t pid = fork();
-    if (pid == 0) {
-        if (strstr(selected, input.buf) != NULL) {
-            execl("/bin/sh", "sh", "-c", selected, (char *)NULL);
-        } else {
-            execl("/bin/sh", "sh", "-c", input.buf, (char *)NULL);
-        }
-        perror("execl");
-        _exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        perror("fork");
-        cleanup();
-        free(selected);
-        exit(1);
-    } else {
-        cleanup();
-        free(selected);
-        exit(0);
+    xcb_allow_events(c, XCB_ALLOW_REPLAY_POINTER, XCB_CURRENT_TIME);
+    xcb_ungrab_button(c, XCB_BUTTON_INDEX_ANY, root, XCB_MOD_MASK_ANY);
+    xcb_unmap_window(c, wid);
+    if (last_focus) {
+        xcb_set_input_focus(c, XCB_INPUT_FOCUS_POINTER_ROOT, last_focus->focus, XCB_CURRENT_TIME);
+        free(last_focus);
+        last_focus = NULL;
     }
+    xcb_flush(c);
+    visible = false;
 }
 
-static int cmpstrs(const void *p1, const void *p2)
+/*
+ * The daemon only hides its window, everything else stays resident. Any
+ * other instance hides it too, then lets a scan under way finish writing
+ * the index before it exits.
+ */
+static void quit(int status)
 {
-    return strcmp(*(const char **)p1, *(const char **)p2);
+    hide();
+    if (daemon_mode) return;
+
+    scan_wait();
+    cleanup();
+    exit(status);
 }
 
-static void parce_dir(char *dirpath)
+static bool shell_syntax(const char *cmd)
 {
-    DIR *dir = opendir(dirpath);
+    return strpbrk(cmd, "\"'`$\\|&;<>()[]{}*?~#=!%\n") != NULL;
+}
 
-    if (!dir) return; 
+/* dmenu mode prints the selection, or the typed input, instead of running it. */
+static void print_selection(void)
+{
+    if (bins.dtop) {
+        fwrite(bin_name(bins.drawable[bins.cursor]), 1, bins.all[bins.drawable[bins.cursor]].len, stdout);
+    } else {
+        fputs(input.buf, stdout);
+    }
+    putchar('\n');
+    fflush(stdout);
+    quit(0);
+}
 
-    size_t i;
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, "..") == 0) continue;
-        if (strcmp(entry->d_name, ".") == 0) continue;
-        for (i = 0; i < bins.top; ++i) {
-            if (strcmp(bins.all[i], entry->d_name) == 0) {
-                break;
-            } 
+/*
+ * A selected bin, or typed input made of plain words, is spawned directly
+ * from the PATH directory the scan found it in and recorded in the launch
+ * history. A desktop entry runs its Exec line through /bin/sh, inside
+ * terminal_command when it asks for a terminal, and is recorded too.
+ * Anything else is handed to /bin/sh. The child always gets a session of
+ * its own.
+ */
+static void run_command(void)
+{
+    if (dmenu_mode) {
+        print_selection();
+        return;
+    }
+
+    char *cmd = strdup(bins.dtop ? bin_name(bins.drawable[bins.cursor]) : input.buf);
+    char *argv[MAX_INPUT_SIZE / 2 + 2];
+    char path[PATH_MAX];
+    const char *file = argv[0] = cmd;
+    const char *dir = NULL;
+    const char *exec = NULL;
+    char *line = NULL;
+    bool search = false;
+    bool shell = false;
+    bool terminal = false;
+
+    if (!cmd) die("Failed to allocate memory\n");
+    if (bins.dtop) exec = bin_exec(bins.drawable[bins.cursor], &terminal);
+
+    if (exec) {
+        size_t size = strlen(terminal_command) + strlen(exec) + 2;
+        line = malloc(size);
+        if (!line) die("Failed to allocate memory\n");
+        snprintf(line, size, "%s%s%s", terminal ? terminal_command : "", terminal ? " " : "", exec);
+        file = "/bin/sh";
+        argv[0] = "sh";
+        argv[1] = "-c";
+        argv[2] = line;
+        argv[3] = NULL;
+    } else if (bins.dtop) {
+        argv[1] = NULL;
+        dir = bin_dir(bins.drawable[bins.cursor]);
+        search = !dir;
+    } else if (shell_syntax(cmd)) {
+        shell = true;
+        file = "/bin/sh";
+        argv[0] = "sh";
+        argv[1] = "-c";
+        argv[2] = cmd;
+        argv[3] = NULL;
+    } else {
+        size_t argc = 0;
+        char *save = NULL;
+        for (char *p = strtok_r(cmd, " \t", &save); p; p = strtok_r(NULL, " \t", &save)) {
+            argv[argc++] = p;
         }
-        if (bins.top == i) {
-            bins.all[bins.top++] = strdup(entry->d_name);
+        argv[argc] = NULL;
+
+        if (argc == 0) {
+            free(cmd);
+            quit(0);
+            return;
         }
-    }
 
-    closedir(dir);
-}
+        file = argv[0];
+        if (!strchr(file, '/')) {
+            ssize_t bin = bins_find(file);
+            dir = bin >= 0 ? bin_dir(bin) : NULL;
+            search = !dir;
+        }
+    }
 
-static void setup(void)
-{
-    char *res = getenv("PATH");
-    char buf[1024];
-    size_t cursor = 0;
-    for (size_t i = 0; i < strlen(res); ++cursor, ++i) {
-        if (res[i] == ':') {
-            buf[cursor] = '\0';
-            parce_dir(buf);
-            cursor = -1;
+    if (dir) {
+        int n = snprintf(path, sizeof(path), "%s/%s", dir, argv[0]);
+        if (n > 0 && (size_t)n < sizeof(path)) {
+            file = path;
         } else {
-            buf[cursor] = res[i];
+            search = true;
         }
     }
 
-    qsort(bins.all, bins.top, sizeof(char *), cmpstrs);
-    
-    bins.rrange_e = COMPLETIONS_NUMBER;
-    input.rrange_e = TEXT_LENGTH;
-
-    dpy = XOpenDisplay(NULL);
-    if (!dpy) {
-        die("Failed to open X11 display\n");
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGCHLD);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    int err = search ? posix_spawnp(&pid, file, NULL, &attr, argv, environ) :
+                       posix_spawn(&pid, file, NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+
+    if (err) {
+        fprintf(stderr, "%s: %s\n", file, strerror(err));
+    } else if (exec) {
+        history_record(cmd);
+    } else if (!shell && !strchr(argv[0], '/')) {
+        history_record(argv[0]);
     }
+    free(line);
+    free(cmd);
+    quit(err ? 1 : 0);
+}
 
-    xlib_scr = DefaultScreen(dpy);
-    visual = DefaultVisual(dpy, xlib_scr);
-    cmap = DefaultColormap(dpy, xlib_scr);
+static void locate_monitor(void)
+{
+    mon_x = 0;
+    mon_y = 0;
+    mon_width = scr->width_in_pixels;
+    mon_height = scr->height_in_pixels;
 
-    c = XGetXCBConnection(dpy);
-    scr = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
-    root = scr->root;
+    xcb_query_pointer_cookie_t pointer_cookie = xcb_query_pointer(c, root);
+    xcb_randr_get_screen_resources_current_cookie_t res_cookie = xcb_randr_get_screen_resources_current(c, root);
 
-    xcb_query_pointer_reply_t *pointer_reply = xcb_query_pointer_reply(c, xcb_query_pointer(c, root), NULL); 
-    int16_t ppx = pointer_reply->root_x;
-    int16_t ppy = pointer_reply->root_y;
+    xcb_query_pointer_reply_t *pointer_reply = xcb_query_pointer_reply(c, pointer_cookie, NULL);
+    xcb_randr_get_screen_resources_current_reply_t *res_reply = xcb_randr_get_screen_resources_current_reply(c, res_cookie, NULL);
 
     if (!pointer_reply) {
         cleanup();
         die("Failed to get pointer reply\n");
     }
 
-    xcb_randr_get_screen_resources_current_reply_t *res_reply = xcb_randr_get_screen_resources_current_reply(c, xcb_randr_get_screen_resources_current(c, root), NULL);
-
     if (!res_reply) {
         cleanup();
         die("Failed to get screen resources reply\n");
     }
 
+    int16_t ppx = pointer_reply->root_x;
+    int16_t ppy = pointer_reply->root_y;
+
     int32_t len = xcb_randr_get_screen_resources_current_outputs_length(res_reply);
     xcb_randr_output_t *outputs = xcb_randr_get_screen_resources_current_outputs(res_reply);
+    xcb_randr_get_output_info_cookie_t *output_cookies = xrealloc(NULL, MAX(len, 1) * sizeof(*output_cookies));
+    xcb_randr_get_crtc_info_cookie_t *crtc_cookies = xrealloc(NULL, MAX(len, 1) * sizeof(*crtc_cookies));
+    int32_t ncrtcs = 0;
 
+    /* One round trip for all outputs, then one for all of their CRTCs. */
     for (int i = 0; i < len; ++i) {
-        xcb_randr_get_output_info_cookie_t output_cookie = xcb_randr_get_output_info(c, outputs[i], XCB_CURRENT_TIME);
-        xcb_randr_get_output_info_reply_t *output_reply = xcb_randr_get_output_info_reply(c, output_cookie, NULL);
+        output_cookies[i] = xcb_randr_get_output_info(c, outputs[i], XCB_CURRENT_TIME);
+    }
 
-        if (!output_reply || output_reply->crtc == XCB_NONE) {
-            continue;
+    for (int i = 0; i < len; ++i) {
+        xcb_randr_get_output_info_reply_t *output_reply = xcb_randr_get_output_info_reply(c, output_cookies[i], NULL);
+
+        if (output_reply && output_reply->crtc != XCB_NONE) {
+            crtc_cookies[ncrtcs++] = xcb_randr_get_crtc_info(c, output_reply->crtc, XCB_CURRENT_TIME);
         }
+        free(output_reply);
+    }
 
-        xcb_randr_get_crtc_info_cookie_t crtc_cookie = xcb_randr_get_crtc_info(c, output_reply->crtc, XCB_CURRENT_TIME);
-        xcb_randr_get_crtc_info_reply_t *crtc_reply = xcb_randr_get_crtc_info_reply(c, crtc_cookie, NULL);
+    bool found = false;
+    for (int i = 0; i < ncrtcs; ++i) {
+        xcb_randr_get_crtc_info_reply_t *crtc_reply = xcb_randr_get_crtc_info_reply(c, crtc_cookies[i], NULL);
 
-        if (!crtc_reply) {
-            free(output_reply);
+        if (!crtc_reply || found) {
+            free(crtc_reply);
             continue;
         }
 
-        if ((ppx >= crtc_reply->x) && (ppx <= crtc_reply->x + crtc_reply->width) &&
-            (ppy >= crtc_reply->y) && (ppy <= crtc_reply->y + crtc_reply->height)) {
+        found = (ppx >= crtc_reply->x) && (ppx <= crtc_reply->x + crtc_reply->width) &&
+                (ppy >= crtc_reply->y) && (ppy <= crtc_reply->y + crtc_reply->height);
+        if (found) {
             mon_x = crtc_reply->x;
             mon_y = crtc_reply->y;
             mon_width = crtc_reply->width;
             mon_height = crtc_reply->height;
-            break;
         }
 
-        free(output_reply);
         free(crtc_reply);
     }
 
+    free(output_cookies);
+    free(crtc_cookies);
     free(pointer_reply);
     free(res_reply);
+}
+
+static void setup(void)
+{
+    match_init();
+    filter_fuzzy = FUZZY_MATCH;
+    filter_keep = COMPLETIONS_NUMBER;
+    if (dmenu_mode) {
+        stdin_start();
+    } else {
+        history_load();
+        scan_start();
+    }
+
+    bins.rrange_e = COMPLETIONS_NUMBER;
+    input.rrange_e = TEXT_LENGTH;
+
+    uint64_t t = trace_now();
+    dpy = XOpenDisplay(NULL);
+    if (!dpy) {
+        die("Failed to open X11 display\n");
+    }
+    trace_phase("open_display", t);
+
+    xlib_scr = DefaultScreen(dpy);
+    visual = DefaultVisual(dpy, xlib_scr);
+    cmap = DefaultColormap(dpy, xlib_scr);
+
+    c = XGetXCBConnection(dpy);
+    scr = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+    root = scr->root;
+
+    /* The RandR query is answered while the font is being opened. */
+    xcb_prefetch_extension_data(c, &xcb_randr_id);
 
     wid = xcb_generate_id(c);
 
+    t = trace_now();
     font = XftFontOpenName(dpy, xlib_scr, fontname);
 
     if (!font) {
         die("Failed to open font\n");
     }
+    trace_phase("font", t);
 
     if ((!XftColorAllocName(dpy, visual, cmap, input_fg_color, &input_font_color)) ||
         (!XftColorAllocName(dpy, visual, cmap, bin_fg_color, &bin_font_color)) ||
@@ -259,11 +480,6 @@ static void setup(void)
         die("Failed to allocate font color\n");
     }
 
-    font_draw = XftDrawCreate(dpy, wid, visual, cmap);
-    if (!font_draw) {
-        die("Failed to allocate font draw\n");
-    }
-
     window_width = TEXT_OFFSET_X * 2 + TEXT_LENGTH * font->max_advance_width;
     window_height = (TEXT_OFFSET_Y * 2 + font->height) * (COMPLETIONS_NUMBER + 1);
 
@@ -277,14 +493,12 @@ static void setup(void)
         XCB_COPY_FROM_PARENT,
         wid,
         root,
-        mon_x + mon_width/2 - window_width/2, mon_y + mon_height/2 - window_height/2, window_width, window_height, 0,
+        0, 0, window_width, window_height, 0,
         XCB_WINDOW_CLASS_INPUT_OUTPUT,
         scr->root_visual,
         value_mask, value_list
     );
 
-    xcb_grab_button(c, 0, root, XCB_EVENT_MASK_BUTTON_PRESS, XCB_GRAB_MODE_SYNC, XCB_GRAB_MODE_SYNC, XCB_NONE, XCB_NONE, XCB_BUTTON_INDEX_ANY, XCB_MOD_MASK_ANY);
-
     input_bar_gc = xcb_generate_id(c);
 
     value_mask = XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES;
@@ -312,113 +526,133 @@ static void setup(void)
     value_list[0] = SELECTED_BIN_BG_COLOR;
     value_list[1] = 0;
     xcb_create_gc(c, selected_gc, root, value_mask, value_list);
+
+    back_buffer = xcb_generate_id(c);
+    xcb_create_pixmap(c, scr->root_depth, back_buffer, wid, window_width, window_height);
+
+    font_draw = XftDrawCreate(dpy, back_buffer, visual, cmap);
+    if (!font_draw) {
+        die("Failed to allocate font draw\n");
+    }
 }
 
-static void draw_input_bar(void)
+static void frame_fill(int kind, int16_t x, int16_t y, uint16_t width, uint16_t height)
 {
-    const xcb_rectangle_t rectangle[] = {
-        {0, 0, input.width, input.height}
-    };
+    frame.fills[kind][frame.nfills[kind]++] = (xcb_rectangle_t){x, y, width, height};
+}
 
-    xcb_poly_fill_rectangle(
-        c,
-        wid,
-        input_bar_gc,
-        1,
-        rectangle
-    );
+static void frame_text(XftColor *color, int x, int y, const char *text, int len)
+{
+    frame.texts[frame.ntexts++] = (frame_text_t){color, x, y, text, len};
+}
 
-    if (input.cursor > input.rrange_e) {
-        input.rrange_s++;
-        input.rrange_e++;
-    } else if (input.cursor < input.rrange_s || (input.top < input.rrange_e && input.top > TEXT_LENGTH - 1)) {
-        input.rrange_s--;
-        input.rrange_e--;
-    }
-    
-    XftDrawStringUtf8(
-        font_draw,
-        &input_font_color,
-        font,
-        TEXT_OFFSET_X,
-        TEXT_OFFSET_Y + (font->height / 1.25),
-        (const FcChar8 *)&input.buf[input.rrange_s],
-        MIN(TEXT_LENGTH, input.top)
-    );
+static void frame_damage(int16_t y, uint16_t height)
+{
+    for (size_t i = 0; i < frame.ndamage; ++i) {
+        xcb_rectangle_t *d = &frame.damage[i];
+        if (y <= d->y + d->height && y + height >= d->y) {
+            int16_t y0 = MIN(d->y, y);
+            d->height = MAX(d->y + d->height, y + height) - y0;
+            d->y = y0;
+            return;
+        }
+    }
+    frame.damage[frame.ndamage++] = (xcb_rectangle_t){0, y, window_width, height};
+}
 
-    int cursor_factor = input.cursor - input.rrange_s;
-    const xcb_rectangle_t cursor[] = {
-        {TEXT_OFFSET_X + font->max_advance_width * cursor_factor, TEXT_OFFSET_Y, 1, font->height}
-    };
+static void frame_present(void)
+{
+    if (!frame.ndamage) return;
 
-    XFlush(dpy);
+    const xcb_gcontext_t gcs[FILL_LAST] = {input_bar_gc, bin_gc, selected_gc, cursor_gc};
 
-    xcb_poly_fill_rectangle(
-        c,
-        wid,
-        cursor_gc,
-        1,
-        cursor
-    );
+    for (int kind = 0; kind < FILL_CURSOR; ++kind) {
+        if (frame.nfills[kind]) {
+            xcb_poly_fill_rectangle(c, back_buffer, gcs[kind], frame.nfills[kind], frame.fills[kind]);
+        }
+    }
+
+    for (size_t i = 0; i < frame.ntexts; ++i) {
+        const frame_text_t *t = &frame.texts[i];
+        XftDrawStringUtf8(font_draw, t->color, font, t->x, t->y, (const FcChar8 *)t->text, t->len);
+    }
+
+    if (frame.nfills[FILL_CURSOR]) {
+        xcb_poly_fill_rectangle(c, back_buffer, cursor_gc, frame.nfills[FILL_CURSOR], frame.fills[FILL_CURSOR]);
+    }
+
+    for (size_t i = 0; i < frame.ndamage; ++i) {
+        const xcb_rectangle_t *d = &frame.damage[i];
+        xcb_copy_area(c, back_buffer, wid, bin_gc, d->x, d->y, d->x, d->y, d->width, d->height);
+    }
 
-    XFlush(dpy);
     xcb_flush(c);
+    memset(&frame, 0, sizeof(frame));
 }
 
-static void draw_bin(const char *cmd, bool selected, int y)
+static void draw_input_bar(void)
 {
-    const xcb_rectangle_t bin_rect[] = {
-        {0, y, window_width, 2 * TEXT_OFFSET_Y + font->height}
-    };
-
-    size_t len = strlen(cmd);
+    frame_fill(FILL_INPUT, 0, 0, input.width, input.height);
+    frame_damage(0, input.height);
 
-    if (selected) {
-        xcb_poly_fill_rectangle(
-            c,
-            wid,
-            selected_gc,
-            1,
-            bin_rect
-        );
+    if (input.cursor > input.rrange_e) {
+        size_t d = input.cursor - input.rrange_e;
+        input.rrange_s += d;
+        input.rrange_e += d;
+    } else if (input.cursor < input.rrange_s) {
+        size_t d = input.rrange_s - input.cursor;
+        input.rrange_s -= d;
+        input.rrange_e -= d;
+    } else if (input.top < input.rrange_e && input.top > TEXT_LENGTH - 1) {
+        size_t d = input.rrange_e - input.top;
+        input.rrange_s -= d;
+        input.rrange_e -= d;
+    }
 
-        XftDrawStringUtf8(
-            font_draw,
-            &selected_font_color,
-            font,
-            TEXT_OFFSET_X,
-            y + font->height,
-            (const FcChar8 *)cmd,
-            MIN(len, TEXT_LENGTH)
-        );
-    } else {
-        xcb_poly_fill_rectangle(
-            c,
-            wid,
-            bin_gc,
-            1,
-            bin_rect
-        );
+    frame_text(
+        &input_font_color,
+        TEXT_OFFSET_X,
+        TEXT_OFFSET_Y + (font->height / 1.25),
+        &input.buf[input.rrange_s],
+        MIN(TEXT_LENGTH, input.top)
+    );
 
-        XftDrawStringUtf8(
-            font_draw,
-            &bin_font_color,
-            font,
-            TEXT_OFFSET_X,
-            y + font->height,
-            (const FcChar8 *)cmd,
-            MIN(len, TEXT_LENGTH)
+    /* The match count goes right-aligned, as long as it does not run into the query. */
+    static char count[24];
+    int n = snprintf(count, sizeof(count), "%zu%s", bins.dtop, bins.dcomplete ? "" : "+");
+    if (input.top + n < TEXT_LENGTH) {
+        frame_text(
+            &input_font_color,
+            TEXT_OFFSET_X + font->max_advance_width * (TEXT_LENGTH - n),
+            TEXT_OFFSET_Y + (font->height / 1.25),
+            count,
+            n
         );
     }
 
-    XFlush(dpy);
-    xcb_flush(c);
+    int cursor_factor = input.cursor - input.rrange_s;
+    frame_fill(FILL_CURSOR, TEXT_OFFSET_X + font->max_advance_width * cursor_factor, TEXT_OFFSET_Y, 1, font->height);
+}
+
+static void draw_bin(uint32_t bin, bool selected, int y)
+{
+    uint16_t height = 2 * TEXT_OFFSET_Y + font->height;
+
+    frame_fill(selected ? FILL_SELECTED : FILL_BIN, 0, y, window_width, height);
+    frame_damage(y, height);
+    frame_text(
+        selected ? &selected_font_color : &bin_font_color,
+        TEXT_OFFSET_X,
+        y + font->height,
+        bin_name(bin),
+        MIN(bins.all[bin].len, TEXT_LENGTH)
+    );
 }
 
 static void redraw_all(void)
 {
     int dy = 2 * TEXT_OFFSET_Y + font->height;
-    for (size_t i = bins.rrange_s; i < bins.rrange_e; ++i) {
+    for (size_t i = bins.rrange_s; i < bins.rrange_e && i < bins.dtop; ++i) {
         draw_bin(bins.drawable[i], bins.cursor == i, dy);
         dy += 2 * TEXT_OFFSET_Y + font->height;
     }
@@ -427,7 +661,7 @@ static void redraw_all(void)
 static void redraw_diff(void)
 {
     int dy = 2 * TEXT_OFFSET_Y + font->height;
-    for (size_t i = bins.rrange_s; i < bins.rrange_e; ++i) {
+    for (size_t i = bins.rrange_s; i < bins.rrange_e && i < bins.dtop; ++i) {
         if (i == bins.cursor || i == bins.prevcursor) {
             draw_bin(bins.drawable[i], bins.cursor == i, dy);
         }
@@ -435,17 +669,36 @@ static void redraw_diff(void)
     }
 }
 
+/* Lets a long filter give way to events that arrived while it ran. */
+static bool input_pending(void)
+{
+    struct pollfd p = {xcb_get_file_descriptor(c), POLLIN, 0};
+    return poll(&p, 1, 0) > 0;
+}
+
+/* Warms the page cache for the highlighted bin while the user decides. */
+static void prefetch_selection(void)
+{
+    if (dmenu_mode || !bins.dtop) return;
+
+    uint32_t bin = bins.drawable[bins.cursor];
+    const char *dir = bin_dir(bin);
+    char path[PATH_MAX];
+    if (!dir) return;
+
+    int n = snprintf(path, sizeof(path), "%s/%s", dir, bin_name(bin));
+    if (n > 0 && (size_t)n < sizeof(path)) prefetch_request(path);
+}
+
+/* Only the matches up to the cursor's page are looked for here, filter_step() finds the rest. */
 static void draw_bins(bool parse_bins)
 {
+    static size_t drawn;
+
     if (parse_bins) {
-        bins.dtop = 0;
-        for (size_t i = 0; i < bins.top; ++i) {
-            if (strstr(bins.all[i], input.buf) != NULL) {
-                bins.drawable[bins.dtop++] = bins.all[i];
-            }
-        }
+        filter_bins(input.buf, input.top, MAX(bins.rrange_e, bins.cursor + 1));
 
-        if (bins.cursor > bins.dtop) {
+        if (bins.cursor >= bins.dtop) {
             bins.cursor = 0;
             bins.prevcursor = 0;
             bins.rrange_s = 0;
@@ -454,35 +707,29 @@ static void draw_bins(bool parse_bins)
     }
 
     if (bins.cursor >= bins.rrange_e) {
-        bins.rrange_s++;
-        bins.rrange_e++;
+        bins.rrange_e = bins.cursor + 1;
+        bins.rrange_s = bins.rrange_e - COMPLETIONS_NUMBER;
         redraw_all();
     } else if (bins.cursor < bins.rrange_s) {
-        bins.rrange_s--;
-        bins.rrange_e--;
+        bins.rrange_s = bins.cursor;
+        bins.rrange_e = bins.rrange_s + COMPLETIONS_NUMBER;
         redraw_all();
-    } else if (parse_bins) {
+    } else if (parse_bins || bins.dtop != drawn) {
         redraw_all();
     } else {
         redraw_diff();
     }
 
     if (bins.dtop < COMPLETIONS_NUMBER) {
-        int dy = (bins.dtop + 1) * (2 * TEXT_OFFSET_Y + font->height); 
-        const xcb_rectangle_t void_rect[] = {
-            {0, dy, window_width, (COMPLETIONS_NUMBER - bins.dtop) * (2 * TEXT_OFFSET_Y + font->height)}
-        };
-
-        xcb_poly_fill_rectangle(
-            c,
-            wid,
-            bin_gc,
-            1,
-            void_rect
-        );
+        int dy = (bins.dtop + 1) * (2 * TEXT_OFFSET_Y + font->height);
+        uint16_t height = (COMPLETIONS_NUMBER - bins.dtop) * (2 * TEXT_OFFSET_Y + font->height);
+        frame_fill(FILL_BIN, 0, dy, window_width, height);
+        frame_damage(dy, height);
     }
-    XFlush(dpy);
-    xcb_flush(c);
+
+    bins.prevcursor = bins.cursor;
+    drawn = bins.dtop;
+    prefetch_selection();
 }
 
 static XKeyEvent cast_key_press_event(xcb_key_press_event_t *e)
@@ -505,7 +752,9 @@ static XKeyEvent cast_key_press_event(xcb_key_press_event_t *e)
     return xkey;
 }
 
-static bool handle_key_press(xcb_generic_event_t *ev)
+/* stale is set when earlier keys of the same burst edited the input but the
+ * list has not been filtered yet. */
+static bool handle_key_press(xcb_generic_event_t *ev, bool stale)
 {
     XKeyEvent e = cast_key_press_event((xcb_key_press_event_t *)ev);
     char buf;
@@ -656,13 +905,26 @@ static bool handle_key_press(xcb_generic_event_t *ev)
             }
             break;
         case XK_Return:
+            if (stale) {
+                filter_bins(input.buf, input.top, bins.cursor + 1);
+                while (filter_pending()) filter_step(NULL);
+                if (bins.cursor >= bins.dtop) bins.cursor = 0;
+            }
             run_command();
             break;
         case XK_Down:
-            if (bins.cursor + 1 < bins.dtop) bins.prevcursor = bins.cursor++;
+            if (!stale && !bins.dcomplete && bins.cursor + 1 >= bins.dtop) filter_more(bins.cursor + 2);
+            if (bins.cursor + 1 < bins.dtop) bins.cursor++;
             break;
         case XK_Up:
-            if (bins.cursor > 0) bins.prevcursor = bins.cursor--;
+            if (bins.cursor > 0) bins.cursor--;
+            break;
+        case XK_Next:
+            if (!stale && !bins.dcomplete) filter_more(bins.cursor + COMPLETIONS_NUMBER + 1);
+            if (bins.dtop) bins.cursor = MIN(bins.cursor + COMPLETIONS_NUMBER, bins.dtop - 1);
+            break;
+        case XK_Prior:
+            bins.cursor -= MIN(bins.cursor, COMPLETIONS_NUMBER);
             break;
         case XK_Right:
             if (input.cursor < input.top) input.cursor++;
@@ -671,10 +933,10 @@ static bool handle_key_press(xcb_generic_event_t *ev)
             if (input.cursor > 0) input.cursor--;
             break;
         case XK_Escape:
-            cleanup();
-            exit(1);
+            quit(1);
+            break;
         default:
-            if (isprint(buf) && input.top < MAX_INPUT_SIZE) {
+            if (isprint(buf) && input.top < MAX_INPUT_SIZE - 1) {
                 memmove(&input.buf[input.cursor + 1], &input.buf[input.cursor], input.top - input.cursor);
                 input.buf[input.cursor++] = buf;
                 input.top++;
@@ -687,40 +949,275 @@ static bool handle_key_press(xcb_generic_event_t *ev)
     return false;
 }
 
-int main(void)
+static void show(void)
 {
-    setup();
-
-    input.width = window_width;
-    input.height = font->height + TEXT_OFFSET_Y * 2;
+    if (visible) return;
+
+    uint64_t t = trace_now();
+    xcb_get_input_focus_cookie_t focus_cookie = xcb_get_input_focus(c);
+    locate_monitor();
+    trace_phase("randr", t);
+    trace_shown = t;
+    t = trace_now();
+    value_list[0] = mon_x + mon_width / 2 - window_width / 2;
+    value_list[1] = mon_y + mon_height / 2 - window_height / 2;
+    xcb_configure_window(c, wid, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y, value_list);
+
+    memset(input.buf, 0, sizeof(input.buf));
     input.top = 0;
     input.cursor = 0;
+    input.rrange_s = 0;
+    input.rrange_e = TEXT_LENGTH;
+    bins.cursor = 0;
+    bins.prevcursor = 0;
+    bins.rrange_s = 0;
+    bins.rrange_e = COMPLETIONS_NUMBER;
 
+    xcb_grab_button(c, 0, root, XCB_EVENT_MASK_BUTTON_PRESS, XCB_GRAB_MODE_SYNC, XCB_GRAB_MODE_SYNC, XCB_NONE, XCB_NONE, XCB_BUTTON_INDEX_ANY, XCB_MOD_MASK_ANY);
     xcb_map_window(c, wid);
 
-    last_focus = xcb_get_input_focus_reply(c, xcb_get_input_focus(c), NULL);
+    free(last_focus);
+    last_focus = xcb_get_input_focus_reply(c, focus_cookie, NULL);
     xcb_set_input_focus(c, XCB_INPUT_FOCUS_POINTER_ROOT, wid, XCB_CURRENT_TIME);
 
     xcb_flush(c);
+    visible = true;
+    trace_phase("map", t);
+}
+
+/* DISPLAY may hold slashes, as in unix/:0, those are replaced in the socket name. */
+static bool daemon_socket(void)
+{
+    const char *display = getenv("DISPLAY");
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    char *path = daemon_addr.sun_path;
+    size_t size = sizeof(daemon_addr.sun_path);
+    int n;
+
+    daemon_addr.sun_family = AF_UNIX;
+    if (runtime && *runtime) {
+        n = snprintf(path, size, "%s/arun", runtime);
+    } else {
+        n = snprintf(path, size, "/tmp/arun-%d", (int)getuid());
+    }
+    if (n < 0 || (size_t)n >= size) {
+        path[0] = '\0';
+        return false;
+    }
+
+    char *name = path + n;
+    n = snprintf(name, size - n, "%s.sock", display ? display : "");
+    if (n < 0 || (size_t)n >= size - (name - path)) {
+        path[0] = '\0';
+        return false;
+    }
+
+    for (char *p = name; *p; ++p) {
+        if (*p == '/') *p = '_';
+    }
+    return true;
+}
+
+static int daemon_connect(void)
+{
+    if (!daemon_socket()) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    if (connect(fd, (struct sockaddr *)&daemon_addr, sizeof(daemon_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Asks a running daemon to pop up, returns false when there is none. */
+static bool daemon_trigger(void)
+{
+    int fd = daemon_connect();
+    if (fd < 0) return false;
+
+    bool ok = send(fd, "show\n", 5, MSG_NOSIGNAL) == 5;
+    close(fd);
+    return ok;
+}
+
+static void daemon_listen(void)
+{
+    int fd = daemon_connect();
+    if (fd >= 0) {
+        close(fd);
+        die("arun daemon is already running\n");
+    }
+    if (!daemon_addr.sun_path[0]) die("Failed to build daemon socket path\n");
+
+    unlink(daemon_addr.sun_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr *)&daemon_addr, sizeof(daemon_addr)) < 0 ||
+        listen(listen_fd, 8) < 0) {
+        die("Failed to listen on daemon socket\n");
+    }
+}
+
+/* Reads the request of the accepted client, or leaves it to the event loop until it arrives. */
+static void daemon_read(void)
+{
+    char buf[16];
+    ssize_t n = read(client_fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+
+    close(client_fd);
+    client_fd = -1;
+    if (n >= 4 && memcmp(buf, "show", 4) == 0) show();
+}
+
+/* Clients never block the UI thread, a slow one is dropped for the next. */
+static void daemon_accept(void)
+{
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+
+    if (client_fd >= 0) close(client_fd);
+    client_fd = fd;
+    daemon_read();
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--daemon") == 0) {
+            daemon_mode = true;
+        } else if (strcmp(argv[i], "--dmenu") == 0) {
+            dmenu_mode = true;
+        } else {
+            die("usage: arun [--daemon | --dmenu]\n");
+        }
+    }
+    if (daemon_mode && dmenu_mode) die("usage: arun [--daemon | --dmenu]\n");
+
+    trace_open();
+
+    if (!daemon_mode && !dmenu_mode && daemon_trigger()) {
+        return 0;
+    }
+
+    setup();
+
+    input.width = window_width;
+    input.height = font->height + TEXT_OFFSET_Y * 2;
+
+    if (daemon_mode) {
+        /* Launched commands are children of the daemon, let the kernel reap them. */
+        signal(SIGCHLD, SIG_IGN);
+        daemon_listen();
+    } else {
+        show();
+    }
+    if (!dmenu_mode) watch_start();
+
+    struct pollfd fds[] = {
+        {xcb_get_file_descriptor(c), POLLIN, 0},
+        {scan_pipe[0], POLLIN, 0},
+        {listen_fd, POLLIN, 0},
+        {-1, POLLIN, 0},
+        {-1, POLLIN, 0},
+    };
 
     while (c && !xcb_connection_has_error(c)) {
-        ev = xcb_wait_for_event(c);
-        switch (ev->response_type & ~0x80) {
-        case XCB_EXPOSE:
-            draw_input_bar();
-            draw_bins(true);
-            break;
-        case XCB_KEY_PRESS:
-            parse_bins = handle_key_press(ev);
+        bool exposed = false;
+        bool pressed = false;
+        bool parse_bins = false;
+        uint64_t handled = 0;
+        int keys = 0;
+
+        /* Apply a whole burst of queued events before filtering and drawing once. */
+        while ((ev = xcb_poll_for_event(c)) != NULL) {
+            switch (ev->response_type & ~0x80) {
+            case XCB_EXPOSE:
+                exposed = true;
+                break;
+            case XCB_KEY_PRESS: {
+                if (!visible) break;
+                uint64_t t = trace_now();
+                parse_bins |= handle_key_press(ev, parse_bins);
+                handled += trace_now() - t;
+                pressed = true;
+                keys++;
+                break;
+            }
+            case XCB_BUTTON_PRESS:
+                quit(1);
+                break;
+            }
+            free(ev);
+        }
+
+        if (visible && (exposed || pressed)) {
+            uint64_t start = trace_now();
+            draw_bins(exposed || parse_bins);
             draw_input_bar();
-            draw_bins(parse_bins);
-            break;
-        case XCB_BUTTON_PRESS:
-            cleanup();
-            exit(1);
-            break;
+            uint64_t drawn = trace_now();
+            frame_present();
+
+            if (pressed) trace_keys(keys, handled, start, drawn, trace_now());
+            if (exposed && trace_shown) {
+                trace_phase("paint", trace_shown);
+                trace_shown = 0;
+            }
+        }
+
+        frame_present();
+
+        /* Matches left to find or rank are worked through while no event is waiting. */
+        fds[3].fd = scan_pipe[0] < 0 ? inotify_fd : -1;
+        fds[4].fd = client_fd;
+        int ready = poll(fds, 5, visible && filter_pending() ? 0 : -1);
+        if (ready < 0 && errno != EINTR) break;
+
+        /* Only the match count is repainted while the visible rows stay the same. */
+        if (ready == 0) {
+            size_t dtop = bins.dtop;
+            bool dcomplete = bins.dcomplete;
+            bool rows = filter_step(input_pending);
+            if (rows) draw_bins(true);
+            if (rows || bins.dtop != dtop || bins.dcomplete != dcomplete) {
+                draw_input_bar();
+                frame_present();
+            }
+            continue;
+        }
+
+        if (fds[1].fd >= 0 && fds[1].revents) {
+            if (scan_collect()) {
+                filter_reset();
+                if (visible) {
+                    draw_bins(true);
+                    draw_input_bar();
+                    frame_present();
+                }
+            }
+            if (scan_pipe[0] < 0) trace_span("scan", scan_begin, scan_end);
+            fds[1].fd = scan_pipe[0];
+        }
+
+        if (fds[4].fd >= 0 && fds[4].revents) {
+            daemon_read();
+        }
+
+        if (fds[2].fd >= 0 && fds[2].revents) {
+            daemon_accept();
+        }
+
+        if (fds[3].fd >= 0 && fds[3].revents && watch_collect()) {
+            filter_reset();
+            if (visible) {
+                draw_bins(true);
+                draw_input_bar();
+                frame_present();
+            }
         }
-        free(ev);
     }
 
     cleanup();
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "bins.h"
+#include "config.h"
+
+#define BENCH_DIRS 16
+#define BENCH_QUERIES 64
+#define BENCH_CHECKS 1000000
+
+/*
+ * Headless benchmark of the store: builds a synthetic PATH of BENCH_DIRS
+ * directories holding the requested number of names, times a cold scan and
+ * a warm one served from the index, then replays typing sequences through
+ * filter_bins() one keystroke at a time. Every key is timed until its first
+ * page is there and again until filter_step() has found and ranked the rest.
+ * --check instead cross-checks the substring kernels against memmem().
+ */
+
+static uint64_t rng = 0x9e3779b97f4a7c15u;
+
+static uint32_t next_rand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng >> 32;
+}
+
+/* Names look like real binaries: lowercase words, digits and separators, mostly short. */
+static size_t make_name(char *buf)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz0123456789-_.";
+    size_t len = 2 + next_rand() % 8;
+    if (next_rand() % 4 == 0) len += next_rand() % 24;
+
+    for (size_t i = 0; i < len; ++i) {
+        buf[i] = chars[next_rand() % (sizeof(chars) - 1)];
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+/* Roughly one name in twenty also shows up in a second directory. */
+static void make_tree(const char *root, size_t entries)
+{
+    char path[PATH_MAX];
+    char name[64];
+    char *env = xrealloc(NULL, BENCH_DIRS * (strlen(root) + 16));
+    size_t elen = 0;
+
+    for (int d = 0; d < BENCH_DIRS; ++d) {
+        snprintf(path, sizeof(path), "%s/bin%d", root, d);
+        if (mkdir(path, 0755) < 0) die("Failed to create directory\n");
+        elen += sprintf(env + elen, "%s%s", d ? ":" : "", path);
+    }
+
+    for (size_t i = 0; i < entries; ++i) {
+        make_name(name);
+        int copies = next_rand() % 20 == 0 ? 2 : 1;
+        for (int j = 0; j < copies; ++j) {
+            snprintf(path, sizeof(path), "%s/bin%u/%s", root, next_rand() % BENCH_DIRS, name);
+            int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    setenv("PATH", env, 1);
+    snprintf(path, sizeof(path), "%s/cache", root);
+    setenv("XDG_CACHE_HOME", path, 1);
+    setenv("XDG_DATA_HOME", root, 1);
+    setenv("XDG_DATA_DIRS", root, 1);
+    free(env);
+}
+
+static double scan(void)
+{
+    uint64_t start = now_ns();
+
+    scan_start();
+    while (scan_pipe[0] >= 0) {
+        struct pollfd p = {scan_pipe[0], POLLIN, 0};
+        poll(&p, 1, -1);
+        scan_collect();
+    }
+    return (now_ns() - start) / 1e6;
+}
+
+static int cmpu64(const void *p1, const void *p2)
+{
+    uint64_t a = *(const uint64_t *)p1;
+    uint64_t b = *(const uint64_t *)p2;
+    return (a > b) - (a < b);
+}
+
+static void filter_key(char *q, const char *name, size_t typed, uint64_t *page, uint64_t *settled)
+{
+    memcpy(q, name, typed);
+    q[typed] = '\0';
+
+    uint64_t start = now_ns();
+    filter_bins(q, typed, filter_keep);
+    *page = now_ns() - start;
+    while (filter_pending()) filter_step(NULL);
+    *settled = now_ns() - start;
+}
+
+static void report(const char *mode, uint64_t *times, size_t ntimes)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < ntimes; ++i) total += times[i];
+    qsort(times, ntimes, sizeof(uint64_t), cmpu64);
+
+    printf("  %-9s %6zu keys  mean %9.1f us  p50 %9.1f us  p99 %9.1f us  max %9.1f us\n",
+           mode, ntimes, total / 1e3 / ntimes, times[ntimes / 2] / 1e3,
+           times[ntimes * 99 / 100] / 1e3, times[ntimes - 1] / 1e3);
+}
+
+/*
+ * Every query types an existing name, or the tail of one, a key at a time,
+ * then backspaces half of it and types it again, as someone correcting a
+ * typo would.
+ */
+static void bench_filter(const char *mode, bool fuzzy)
+{
+    uint64_t *pages = NULL;
+    uint64_t *settled = NULL;
+    size_t ntimes = 0;
+    char q[MAX_INPUT_SIZE];
+
+    filter_fuzzy = fuzzy;
+    filter_reset();
+
+    for (int n = 0; n < BENCH_QUERIES && bins.top > 0; ++n) {
+        uint32_t bin = next_rand() % bins.top;
+        const char *name = bin_name(bin);
+        size_t len = bins.all[bin].len;
+        size_t skip = next_rand() % 2 ? len / 3 : 0;
+        size_t k = MIN(len - skip, MAX_INPUT_SIZE - 1);
+
+        pages = xrealloc(pages, (ntimes + 3 * k + 1) * sizeof(uint64_t));
+        settled = xrealloc(settled, (ntimes + 3 * k + 1) * sizeof(uint64_t));
+        for (size_t t = 0; t <= k; ++t, ++ntimes) {
+            filter_key(q, name + skip, t, &pages[ntimes], &settled[ntimes]);
+        }
+        for (size_t t = k; t-- > k / 2; ++ntimes) {
+            filter_key(q, name + skip, t, &pages[ntimes], &settled[ntimes]);
+        }
+        for (size_t t = k / 2 + 1; t <= k; ++t, ++ntimes) {
+            filter_key(q, name + skip, t, &pages[ntimes], &settled[ntimes]);
+        }
+    }
+
+    if (ntimes > 0) {
+        report(mode, pages, ntimes);
+        report("  settled", settled, ntimes);
+    }
+    free(pages);
+    free(settled);
+}
+
+static void bench(size_t entries)
+{
+    char root[] = "/tmp/arun-bench-XXXXXX";
+    if (!mkdtemp(root)) die("Failed to create temporary directory\n");
+
+    make_tree(root, entries);
+
+    double cold = scan();
+    bins_cleanup();
+    double warm = scan();
+
+    size_t store = bins.size * sizeof(bin_t) + (bins.psize ? bins.psize : bins.plen + POOL_PAD);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("%zu entries, %zu unique\n", entries, bins.top);
+    printf("  scan      cold %9.2f ms  warm %9.2f ms\n", cold, warm);
+    printf("  memory    store %7zu KiB  max rss %7ld KiB\n", store / 1024, ru.ru_maxrss);
+
+    bench_filter("substring", false);
+    bench_filter("fuzzy", true);
+
+    bins_cleanup();
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = {1000, 10000, 100000};
+
+    match_init();
+    filter_keep = COMPLETIONS_NUMBER;
+
+    if (argc == 2 && strcmp(argv[1], "--check") == 0) {
+        size_t failed = match_check(BENCH_CHECKS);
+        printf("%zu kernel cases, %zu mismatches\n", (size_t)BENCH_CHECKS, failed);
+        return failed != 0;
+    }
+
+    if (argc < 2) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) bench(sizes[i]);
+        return 0;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        char *end;
+        unsigned long n = strtoul(argv[i], &end, 10);
+        if (*end || n == 0) die("usage: arun-bench [--check | entries...]\n");
+        bench(n);
+    }
+    return 0;
+}
@@ -0,0 +1,2925 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_SSE2
+#include <immintrin.h>
+#endif
+
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include "bins.h"
+
+#define SCAN_THREADS 8
+#define STAT_BATCH 256
+#define STDIN_CHUNK (256 * 1024)
+#define FILTER_THREADS 8
+#define FILTER_CHUNK 16384
+#define FILTER_EAGER 65536
+#define FILTER_STEP (FILTER_THREADS * FILTER_CHUNK * 2)
+#define FILTER_ROWS 64
+#define TRIGRAM_MAX_PAIRS (4 * 1024 * 1024)
+
+#define SCORE_MATCH 16
+#define SCORE_GAP_START -3
+#define SCORE_GAP_EXTENSION -1
+#define BONUS_BOUNDARY 8
+#define BONUS_CONSECUTIVE 4
+#define BONUS_PREFIX 16
+
+#define CACHE_MAGIC "ARUNIDX6"
+#define APPS_MAGIC "ARUNAPP1"
+#define APP_FILE_MAX (1024 * 1024)
+#define HISTORY_MAGIC "ARUNHST1"
+#define HISTORY_ENTRIES 256
+#define HISTORY_AGING 2000
+#define HISTORY_BONUS 32
+
+/* Names found by the scan thread, sorted, with their own pool. */
+typedef struct batch {
+    char *pool;
+    size_t plen;
+    bool mapped;
+    bin_t *names;
+    size_t count;
+    struct batch *next;
+} batch_t;
+
+typedef struct {
+    const char *path;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    char *blob;
+    size_t blen;
+    size_t bsize;
+    const char *base;
+    bin_t *names;
+    size_t count;
+    size_t size;
+    bool ready;
+} path_dir_t;
+
+
+/*
+ * items[0..count) are the matches among the first scanned items of the
+ * level's source, in source order. The level is complete once its source
+ * is complete and has been scanned to the end.
+ */
+typedef struct {
+    size_t qlen;
+    bool icase;
+    bool complete;
+    uint32_t *items;
+    size_t count;
+    size_t size;
+    size_t scanned;
+} filter_level_t;
+
+/*
+ * Trigram index over bins.all[0..count): postings[starts[i]..starts[i + 1])
+ * are the bins containing keys[i], in ascending order.
+ */
+typedef struct {
+    uint32_t *keys;
+    uint32_t *starts;
+    uint32_t *postings;
+    size_t nkeys;
+    size_t count;
+    bool disabled;
+} trigrams_t;
+
+typedef struct {
+    int score;
+    uint32_t len;
+    uint32_t pos;
+} rank_t;
+
+/*
+ * On-disk index, mapped read-only at startup:
+ *
+ *     cache_header_t | cache_dir_t[ndirs] | bin_t names[nnames] |
+ *     bin_t refs[nrefs] | char strings[strsize]
+ *
+ * names is the sorted, deduplicated bin list and strings doubles as its
+ * pool, so a fresh index is used without copying a single name. strings
+ * ends with POOL_PAD zero bytes, as any pool does. Every dir
+ * owns refs[first..first + count), the full listing of that directory, so
+ * only directories whose stat changed have to be rescanned.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t ndirs;
+    uint32_t nnames;
+    uint32_t nrefs;
+    uint32_t strsize;
+} cache_header_t;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t path;
+    uint32_t first;
+    uint32_t count;
+    uint32_t pad;
+} cache_dir_t;
+
+/*
+ * Desktop entries, cached apart from the index:
+ *
+ *     apps_header_t | cache_dir_t dirs[ndirs] | app_t apps[napps] |
+ *     char strings[strsize]
+ *
+ * dirs are the applications directories of XDG_DATA_HOME and XDG_DATA_DIRS
+ * in lookup order, only their path and stat fields are used. apps is sorted
+ * by name, and exec is the Exec line with its field codes removed. strings
+ * ends with POOL_PAD zero bytes and is handed to the store as a pool.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t ndirs;
+    uint32_t napps;
+    uint32_t strsize;
+    uint32_t pad;
+} apps_header_t;
+
+typedef struct {
+    bin_t name;
+    uint32_t exec;
+    uint32_t terminal;
+} app_t;
+
+/*
+ * Launch history, kept in its own small file:
+ *
+ *     history_header_t | history_entry_t entries[count]
+ *
+ * count is at most HISTORY_ENTRIES. Once the counts add up to more than
+ * HISTORY_AGING they are all cut by a tenth and entries reaching zero are
+ * dropped, so old habits fade. A new name replaces the entry with the
+ * lowest frecency when the file is full.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t pad;
+} history_header_t;
+
+typedef struct {
+    char name[48];
+    uint32_t count;
+    uint32_t pad;
+    int64_t last;
+} history_entry_t;
+
+/* Rank bonus of a bin launched before, sorted by bin. */
+typedef struct {
+    uint32_t bin;
+    int bonus;
+} boost_t;
+
+bins_t bins;
+int scan_pipe[2] = {-1, -1};
+int inotify_fd = -1;
+uint64_t scan_begin;
+uint64_t scan_end;
+bool filter_fuzzy;
+size_t filter_keep;
+
+static path_dir_t *dirs;
+static size_t ndirs;
+static char *cache_map;
+static size_t cache_size;
+static pthread_t scan_tid;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static batch_t *scan_head;
+static batch_t *scan_tail;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+static bool scan_done = true;
+static pthread_mutex_t dirs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dirs_cond = PTHREAD_COND_INITIALIZER;
+static size_t dirs_next;
+static bool stdin_mode;
+static bool stat_async;
+static char *apps_image;
+static size_t apps_image_size;
+static bool apps_mapped;
+static const app_t *apps;
+static size_t napps;
+static const char *apps_strings;
+static char *stdin_map;
+static size_t stdin_size;
+static char **path_dirs;
+static size_t npath_dirs;
+static int *watches;
+static uid_t euid;
+static gid_t *groups;
+static size_t ngroups;
+static filter_level_t levels[MAX_INPUT_SIZE];
+static size_t nlevels;
+static char filter_query[MAX_INPUT_SIZE];
+static bool filter_icase;
+static bool filter_ranked;
+static size_t ranked_chunks;
+static uint32_t *ranked;
+static size_t ranked_size;
+static rank_t *heap;
+static size_t heap_size;
+static trigrams_t trigrams;
+static bool trigrams_valid;
+static bool trigrams_stale;
+static pthread_mutex_t trigram_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trigram_cond = PTHREAD_COND_INITIALIZER;
+static bool trigram_building;
+static bool trigram_done;
+static trigrams_t trigram_result;
+static bin_t *trigram_names;
+static char *trigram_pool;
+static size_t *chunk_counts;
+static size_t chunk_counts_size;
+static history_entry_t history[HISTORY_ENTRIES];
+static size_t nhistory;
+static boost_t boosts[HISTORY_ENTRIES];
+static size_t nboosts;
+static bool boosts_built;
+static rank_t *chunk_heaps;
+static size_t chunk_heaps_size;
+
+/*
+ * Filter worker pool. The chunks of the current job are handed out under
+ * pool_lock to the workers and to the thread running the job alike.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+static bool pool_started;
+static void (*pool_fn)(size_t chunk);
+static size_t pool_nchunks;
+static size_t pool_next;
+static size_t pool_finished;
+
+/* Input of the running job, written before it starts and read-only while it runs. */
+static struct {
+    const uint32_t *from;
+    uint32_t base;
+    uint32_t *items;
+    size_t n;
+    size_t first;
+    const char *q;
+    size_t k;
+    bool icase;
+} job;
+
+void die(const char *msg)
+{
+    fprintf(stderr, "%s", msg);
+    exit(1);
+}
+
+void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (!p) die("Failed to allocate memory\n");
+    return p;
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int cmpbins(const void *p1, const void *p2, void *pool)
+{
+    const bin_t *a = p1;
+    const bin_t *b = p2;
+    return strcmp((const char *)pool + a->off, (const char *)pool + b->off);
+}
+
+static size_t bins_lower_bound(const bins_t *b, const char *name)
+{
+    size_t lo = 0;
+    size_t hi = b->top;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(b->pool + b->all[mid].off, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static ssize_t find_bin(const bins_t *b, const char *name)
+{
+    size_t i = bins_lower_bound(b, name);
+    if (i < b->top && strcmp(b->pool + b->all[i].off, name) == 0) return i;
+    return -1;
+}
+
+ssize_t bins_find(const char *name)
+{
+    return find_bin(&bins, name);
+}
+
+const char *bin_dir(uint32_t i)
+{
+    return bins.all[i].dir < npath_dirs ? path_dirs[bins.all[i].dir] : NULL;
+}
+
+static void dir_add(path_dir_t *dir, uint32_t off, uint32_t len)
+{
+    if (dir->count == dir->size) {
+        dir->size = dir->size ? dir->size * 2 : 256;
+        dir->names = xrealloc(dir->names, dir->size * sizeof(bin_t));
+    }
+    dir->names[dir->count++] = (bin_t){off, len, NO_DIR};
+}
+
+/* The effective ids, read once before the first scan thread starts. */
+static void load_ids(void)
+{
+    if (ngroups) return;
+
+    euid = geteuid();
+    int n = getgroups(0, NULL);
+    groups = xrealloc(NULL, (MAX(n, 0) + 1) * sizeof(gid_t));
+    groups[0] = getegid();
+    n = n > 0 ? getgroups(n, groups + 1) : 0;
+    ngroups = 1 + MAX(n, 0);
+}
+
+/*
+ * A name is offered when it resolves to a regular file the effective user
+ * may execute, by the owner, group or other bit that applies, as
+ * access(X_OK) decides. Only the io_uring path checks the bits itself,
+ * without ACLs; the others ask faccessat().
+ */
+static bool executable(mode_t mode, uid_t uid, gid_t gid)
+{
+    if (!S_ISREG(mode)) return false;
+    if (euid == 0) return mode & 0111;
+    if (uid == euid) return mode & S_IXUSR;
+    for (size_t i = 0; i < ngroups; ++i) {
+        if (groups[i] == gid) return mode & S_IXGRP;
+    }
+    return mode & S_IXOTH;
+}
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int fd;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_size;
+    size_t cq_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+static void uring_free(uring_t *r)
+{
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_size);
+    if (r->sq_ring && r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_size);
+    close(r->fd);
+}
+
+static bool uring_init(uring_t *r, unsigned entries)
+{
+    struct io_uring_params p = {0};
+
+    memset(r, 0, sizeof(*r));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return false;
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) r->sq_size = r->cq_size = MAX(r->sq_size, r->cq_size);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP ? r->sq_ring :
+                 mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        uring_free(r);
+        return false;
+    }
+
+    r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+    return true;
+}
+
+/*
+ * Submits a statx for every name of the directory at once, STAT_BATCH at a
+ * time, and lets the kernel run them concurrently. Entries it could not
+ * stat are left to the fstatat() loop, which also takes over when io_uring
+ * is unavailable. On a single CPU the kernel workers only add overhead, so
+ * it is not used there.
+ */
+static void stat_uring(const path_dir_t *dir, int dirfd, signed char *exec)
+{
+    uring_t r;
+    if (!uring_init(&r, STAT_BATCH)) return;
+
+    struct statx *bufs = malloc(STAT_BATCH * sizeof(struct statx));
+    if (!bufs) die("Failed to allocate memory\n");
+
+    for (size_t start = 0; start < dir->count; start += STAT_BATCH) {
+        unsigned n = MIN(dir->count - start, STAT_BATCH);
+        unsigned tail = *r.sq_tail;
+
+        for (unsigned j = 0; j < n; ++j) {
+            unsigned idx = (tail + j) & *r.sq_mask;
+            struct io_uring_sqe *sqe = &r.sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dirfd;
+            sqe->addr = (uintptr_t)(dir->blob + dir->names[start + j].off);
+            sqe->len = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID;
+            sqe->off = (uintptr_t)&bufs[j];
+            sqe->user_data = j;
+            r.sq_array[idx] = idx;
+        }
+        __atomic_store_n(r.sq_tail, tail + n, __ATOMIC_RELEASE);
+
+        unsigned submit = n;
+        unsigned done = 0;
+        while (done < n) {
+            int ret = syscall(__NR_io_uring_enter, r.fd, submit, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0 && errno != EINTR && submit == n) break;
+            if (ret > 0) submit -= MIN((unsigned)ret, submit);
+
+            unsigned head = *r.cq_head;
+            unsigned ctail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != ctail; ++head, ++done) {
+                const struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+                const struct statx *stx = &bufs[cqe->user_data];
+                if (cqe->res == 0) exec[start + cqe->user_data] = executable(stx->stx_mode, stx->stx_uid, stx->stx_gid);
+            }
+            __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+        }
+        if (done < n) break;
+    }
+
+    free(bufs);
+    uring_free(&r);
+}
+#endif
+
+/* Drops the names that are not executable, with every stat relative to dirfd. */
+static void keep_executables(path_dir_t *dir, int dirfd)
+{
+    signed char *exec = malloc(dir->count + 1);
+    if (!exec) die("Failed to allocate memory\n");
+    memset(exec, -1, dir->count);
+
+#ifdef HAVE_IO_URING
+    if (stat_async && dir->count >= 32) stat_uring(dir, dirfd, exec);
+#endif
+
+    size_t kept = 0;
+    for (size_t i = 0; i < dir->count; ++i) {
+        if (exec[i] < 0) {
+            const char *name = dir->blob + dir->names[i].off;
+            struct stat st;
+            exec[i] = fstatat(dirfd, name, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+                      faccessat(dirfd, name, X_OK, AT_EACCESS) == 0;
+        }
+        if (exec[i]) dir->names[kept++] = dir->names[i];
+    }
+    dir->count = kept;
+    free(exec);
+}
+
+/* d_type rules out directories and special files without a stat. */
+static void parce_dir(path_dir_t *dir)
+{
+    int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    DIR *d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) continue;
+        if (strcmp(entry->d_name, "..") == 0) continue;
+        if (strcmp(entry->d_name, ".") == 0) continue;
+
+        size_t len = strlen(entry->d_name);
+        if (dir->blen + len + 1 > dir->bsize) {
+            dir->bsize = MAX(dir->bsize * 2, dir->blen + len + 1 + 4096);
+            dir->blob = xrealloc(dir->blob, dir->bsize);
+        }
+        memcpy(dir->blob + dir->blen, entry->d_name, len + 1);
+        dir_add(dir, dir->blen, len);
+        dir->blen += len + 1;
+    }
+
+    keep_executables(dir, fd);
+    closedir(d);
+    dir->base = dir->blob;
+}
+
+static void bins_reserve(bins_t *b, size_t n)
+{
+    if (n <= b->size) return;
+
+    size_t size = b->size ? b->size : 1024;
+    while (size < n) size *= 2;
+
+    b->all = xrealloc(b->all, size * sizeof(bin_t));
+    b->size = size;
+}
+
+/* A pool borrowed from the cache mapping is copied before it is grown. */
+static void pool_reserve(bins_t *b, size_t n)
+{
+    if (b->plen + n + POOL_PAD <= b->psize) return;
+
+    size_t size = MAX(b->psize * 2, b->plen + n + POOL_PAD + 65536);
+    if (b->psize == 0 && b->pool) {
+        char *pool = malloc(size);
+        if (!pool) die("Failed to allocate memory\n");
+        memcpy(pool, b->pool, b->plen);
+        b->pool = pool;
+    } else {
+        b->pool = xrealloc(b->pool, size);
+    }
+    b->psize = size;
+}
+
+static uint32_t pool_add(bins_t *b, const char *name, uint32_t len)
+{
+    pool_reserve(b, len + 1);
+    uint32_t off = b->plen;
+    memcpy(b->pool + off, name, len);
+    b->plen += len + 1;
+    memset(b->pool + off + len, 0, 1 + POOL_PAD);
+    return off;
+}
+
+/* Lays the pool out in b->all order so filtering walks it front to back. */
+static void pool_sort(bins_t *b)
+{
+    char *pool = malloc(b->plen + POOL_PAD);
+    if (!pool) die("Failed to allocate memory\n");
+
+    size_t plen = 0;
+    for (size_t i = 0; i < b->top; ++i) {
+        memcpy(pool + plen, b->pool + b->all[i].off, b->all[i].len + 1);
+        b->all[i].off = plen;
+        plen += b->all[i].len + 1;
+    }
+    memset(pool + plen, 0, POOL_PAD);
+
+    if (b->psize) free(b->pool);
+    b->pool = pool;
+    b->plen = plen;
+    b->psize = plen + POOL_PAD;
+}
+
+static uint32_t hash_str(const char *s, uint32_t len)
+{
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void bins_set_grow(bins_t *b)
+{
+    size_t size = b->set_size ? b->set_size * 2 : 4096;
+    uint32_t *set = calloc(size, sizeof(uint32_t));
+    if (!set) die("Failed to allocate memory\n");
+
+    for (size_t i = 0; i < b->top; ++i) {
+        size_t slot = hash_str(b->pool + b->all[i].off, b->all[i].len) & (size - 1);
+        while (set[slot]) slot = (slot + 1) & (size - 1);
+        set[slot] = i + 1;
+    }
+
+    free(b->set);
+    b->set = set;
+    b->set_size = size;
+}
+
+/* Slots hold index + 1 into b->all, 0 marks an empty slot. */
+static void bins_add_unique(bins_t *b, const char *name, uint32_t len, uint16_t dir)
+{
+    if ((b->top + 1) * 2 > b->set_size) bins_set_grow(b);
+
+    size_t slot = hash_str(name, len) & (b->set_size - 1);
+    while (b->set[slot]) {
+        const bin_t *bin = &b->all[b->set[slot] - 1];
+        if (bin->len == len && memcmp(b->pool + bin->off, name, len) == 0) return;
+        slot = (slot + 1) & (b->set_size - 1);
+    }
+
+    bins_reserve(b, b->top + 1);
+    b->set[slot] = b->top + 1;
+    b->all[b->top].off = pool_add(b, name, len);
+    b->all[b->top].len = len;
+    b->all[b->top].dir = dir;
+    b->top++;
+}
+
+static void merge_dir(bins_t *b, size_t i)
+{
+    const path_dir_t *dir = &dirs[i];
+    for (size_t j = 0; j < dir->count; ++j) {
+        bins_add_unique(b, dir->base + dir->names[j].off, dir->names[j].len, i);
+    }
+}
+
+static void free_dirs(void)
+{
+    for (size_t i = 0; i < ndirs; ++i) {
+        free(dirs[i].blob);
+        free(dirs[i].names);
+    }
+    free(dirs);
+    dirs = NULL;
+    ndirs = 0;
+}
+
+/*
+ * PATH is split once, before the scan thread starts, and stays read-only
+ * until bins_cleanup(). A bin's dir indexes this list. Entries past APP_DIR
+ * are ignored.
+ */
+static void split_path(void)
+{
+    char *res = getenv("PATH");
+    if (!res) return;
+
+    char *copy = strdup(res);
+    char *save = NULL;
+    for (char *p = strtok_r(copy, ":", &save); p && npath_dirs < APP_DIR; p = strtok_r(NULL, ":", &save)) {
+        path_dirs = xrealloc(path_dirs, (npath_dirs + 1) * sizeof(char *));
+        path_dirs[npath_dirs++] = strdup(p);
+    }
+    free(copy);
+}
+
+static void stat_dir(path_dir_t *dir)
+{
+    struct stat st;
+    if (stat(dir->path, &st) == 0) {
+        dir->dev = st.st_dev;
+        dir->ino = st.st_ino;
+        dir->mtime_sec = st.st_mtim.tv_sec;
+        dir->mtime_nsec = st.st_mtim.tv_nsec;
+    }
+}
+
+static void stat_dirs(void)
+{
+    dirs = calloc(npath_dirs + 1, sizeof(path_dir_t));
+    if (!dirs) die("Failed to allocate memory\n");
+
+    for (ndirs = 0; ndirs < npath_dirs; ++ndirs) {
+        dirs[ndirs].path = path_dirs[ndirs];
+        stat_dir(&dirs[ndirs]);
+    }
+}
+
+/* Builds $env/arun/name, or ~/fallback/arun/name when env is unset. */
+static bool xdg_file(char *buf, size_t size, const char *env, const char *fallback, const char *name, bool create)
+{
+    const char *xdg = getenv(env);
+    const char *home = getenv("HOME");
+    int n;
+
+    if (xdg && *xdg) {
+        n = snprintf(buf, size, "%s/arun", xdg);
+    } else if (home && *home) {
+        n = snprintf(buf, size, "%s/%s/arun", home, fallback);
+    } else {
+        return false;
+    }
+    if (n < 0 || (size_t)n >= size) return false;
+
+    if (create) {
+        for (char *p = buf + 1; *p; ++p) {
+            if (*p != '/') continue;
+            *p = '\0';
+            mkdir(buf, 0755);
+            *p = '/';
+        }
+        if (mkdir(buf, 0755) < 0 && errno != EEXIST) return false;
+    }
+
+    int m = snprintf(buf + n, size - n, "/%s", name);
+    return m > 0 && (size_t)m < size - n;
+}
+
+static const cache_header_t *load_cache(void)
+{
+    char path[PATH_MAX];
+    if (!xdg_file(path, sizeof(path), "XDG_CACHE_HOME", ".cache", "index", false)) return NULL;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(cache_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const cache_header_t *hdr = map;
+    uint64_t need = sizeof(cache_header_t) +
+                    (uint64_t)hdr->ndirs * sizeof(cache_dir_t) +
+                    ((uint64_t)hdr->nnames + hdr->nrefs) * sizeof(bin_t) +
+                    hdr->strsize;
+
+    static const char pad[POOL_PAD];
+    if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        need != (uint64_t)st.st_size || hdr->strsize < POOL_PAD ||
+        memcmp((const char *)map + st.st_size - POOL_PAD, pad, POOL_PAD) != 0) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    cache_map = map;
+    cache_size = st.st_size;
+    return hdr;
+}
+
+static void unload_cache(void)
+{
+    if (cache_map) munmap(cache_map, cache_size);
+    cache_map = NULL;
+    cache_size = 0;
+}
+
+static bool cache_bins_valid(const cache_header_t *hdr, const bin_t *list, size_t n)
+{
+    const char *strings = cache_map + cache_size - hdr->strsize;
+    for (size_t i = 0; i < n; ++i) {
+        if ((uint64_t)list[i].off + list[i].len >= hdr->strsize) return false;
+        if (strings[list[i].off + list[i].len] != '\0') return false;
+    }
+    return true;
+}
+
+static bool same_stat(const path_dir_t *dir, const cache_dir_t *cd)
+{
+    return dir->dev == cd->dev && dir->ino == cd->ino &&
+           dir->mtime_sec == cd->mtime_sec && dir->mtime_nsec == cd->mtime_nsec;
+}
+
+static const cache_dir_t *find_cached_dir(const cache_header_t *hdr, const char *path)
+{
+    const cache_dir_t *cdirs = (const cache_dir_t *)(hdr + 1);
+    const char *strings = cache_map + cache_size - hdr->strsize;
+
+    for (uint32_t i = 0; i < hdr->ndirs; ++i) {
+        if (cdirs[i].path < hdr->strsize && strcmp(strings + cdirs[i].path, path) == 0) {
+            return &cdirs[i];
+        }
+    }
+    return NULL;
+}
+
+static void drop_cache(void)
+{
+    char path[PATH_MAX];
+    if (xdg_file(path, sizeof(path), "XDG_CACHE_HOME", ".cache", "index", false)) unlink(path);
+}
+
+static void write_cache(const bins_t *b)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 16];
+    if (!xdg_file(path, sizeof(path), "XDG_CACHE_HOME", ".cache", "index", true)) return;
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+    uint32_t paths = 0;
+    uint32_t nrefs = 0;
+    for (size_t i = 0; i < ndirs; ++i) {
+        paths += strlen(dirs[i].path) + 1;
+        nrefs += dirs[i].count;
+    }
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return;
+
+    cache_header_t hdr = {0};
+    memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.ndirs = ndirs;
+    hdr.nnames = b->top;
+    hdr.nrefs = nrefs;
+    hdr.strsize = paths + b->plen + POOL_PAD;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    uint32_t first = 0;
+    uint32_t path_off = 0;
+    for (size_t i = 0; i < ndirs; ++i) {
+        cache_dir_t cd = {
+            .dev = dirs[i].dev,
+            .ino = dirs[i].ino,
+            .mtime_sec = dirs[i].mtime_sec,
+            .mtime_nsec = dirs[i].mtime_nsec,
+            .path = path_off,
+            .first = first,
+            .count = dirs[i].count,
+        };
+        fwrite(&cd, sizeof(cd), 1, f);
+        first += dirs[i].count;
+        path_off += strlen(dirs[i].path) + 1;
+    }
+
+    for (size_t i = 0; i < b->top; ++i) {
+        bin_t bin = {b->all[i].off + paths, b->all[i].len, b->all[i].dir};
+        fwrite(&bin, sizeof(bin), 1, f);
+    }
+
+    for (size_t i = 0; i < ndirs; ++i) {
+        for (size_t j = 0; j < dirs[i].count; ++j) {
+            ssize_t found = find_bin(b, dirs[i].base + dirs[i].names[j].off);
+            bin_t ref = {found < 0 ? 0 : b->all[found].off + paths, dirs[i].names[j].len, i};
+            fwrite(&ref, sizeof(ref), 1, f);
+        }
+    }
+
+    for (size_t i = 0; i < ndirs; ++i) fwrite(dirs[i].path, 1, strlen(dirs[i].path) + 1, f);
+    fwrite(b->pool, 1, b->plen + POOL_PAD, f);
+
+    if (fclose(f) != 0 || rename(tmp, path) != 0) unlink(tmp);
+}
+
+static void scan_post(batch_t *batch)
+{
+    pthread_mutex_lock(&scan_lock);
+    if (batch) {
+        if (scan_tail) {
+            scan_tail->next = batch;
+        } else {
+            scan_head = batch;
+        }
+        scan_tail = batch;
+    } else {
+        scan_done = true;
+        pthread_cond_broadcast(&scan_cond);
+    }
+    pthread_mutex_unlock(&scan_lock);
+
+    char byte = 0;
+    if (write(scan_pipe[1], &byte, 1) < 0 && errno != EAGAIN) perror("write");
+}
+
+/* Hands b->all[from..top), which scan_path() appended to the pool in order, to the main thread. */
+static void post_batch(const bins_t *b, size_t from)
+{
+    if (from == b->top) return;
+
+    batch_t *batch = calloc(1, sizeof(batch_t));
+    size_t start = b->all[from].off;
+    if (!batch) die("Failed to allocate memory\n");
+
+    batch->count = b->top - from;
+    batch->names = malloc(batch->count * sizeof(bin_t));
+    batch->plen = b->plen - start;
+    batch->pool = malloc(batch->plen + POOL_PAD);
+    if (!batch->names || !batch->pool) die("Failed to allocate memory\n");
+
+    memcpy(batch->pool, b->pool + start, batch->plen);
+    memset(batch->pool + batch->plen, 0, POOL_PAD);
+    for (size_t i = 0; i < batch->count; ++i) {
+        batch->names[i].off = b->all[from + i].off - start;
+        batch->names[i].len = b->all[from + i].len;
+        batch->names[i].dir = b->all[from + i].dir;
+    }
+    qsort_r(batch->names, batch->count, sizeof(bin_t), cmpbins, batch->pool);
+
+    scan_post(batch);
+}
+
+/*
+ * Stale directories are read concurrently, each into its own listing, while
+ * scan_path() merges the listings strictly in PATH order as they become
+ * ready. Which directory a name is taken from never depends on timing.
+ */
+static void *dir_worker(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&dirs_lock);
+        while (dirs_next < ndirs && dirs[dirs_next].ready) dirs_next++;
+        size_t i = dirs_next++;
+        pthread_mutex_unlock(&dirs_lock);
+
+        if (i >= ndirs) return NULL;
+
+        parce_dir(&dirs[i]);
+
+        pthread_mutex_lock(&dirs_lock);
+        dirs[i].ready = true;
+        pthread_cond_broadcast(&dirs_cond);
+        pthread_mutex_unlock(&dirs_lock);
+    }
+}
+
+static void scan_path(bins_t *b)
+{
+    stat_dirs();
+    stat_async = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+
+    const cache_header_t *hdr = load_cache();
+    const cache_dir_t *cdirs = hdr ? (const cache_dir_t *)(hdr + 1) : NULL;
+    const bin_t *names = hdr ? (const bin_t *)(cdirs + hdr->ndirs) : NULL;
+    const bin_t *refs = hdr ? names + hdr->nnames : NULL;
+    char *strings = hdr ? cache_map + cache_size - hdr->strsize : NULL;
+
+    bool fresh = hdr && hdr->ndirs == ndirs;
+    for (size_t i = 0; fresh && i < ndirs; ++i) {
+        fresh = cdirs[i].path < hdr->strsize &&
+                strcmp(strings + cdirs[i].path, dirs[i].path) == 0 &&
+                same_stat(&dirs[i], &cdirs[i]);
+    }
+    fresh = fresh && cache_bins_valid(hdr, names, hdr->nnames);
+
+    if (fresh) {
+        batch_t *batch = calloc(1, sizeof(batch_t));
+        if (!batch) die("Failed to allocate memory\n");
+        batch->pool = strings;
+        batch->plen = hdr->strsize - POOL_PAD;
+        batch->mapped = true;
+        batch->count = hdr->nnames;
+        batch->names = malloc((batch->count + 1) * sizeof(bin_t));
+        if (!batch->names) die("Failed to allocate memory\n");
+        memcpy(batch->names, names, batch->count * sizeof(bin_t));
+        scan_post(batch);
+        free_dirs();
+        return;
+    }
+
+    size_t stale = 0;
+    for (size_t i = 0; i < ndirs; ++i) {
+        const cache_dir_t *cd = hdr ? find_cached_dir(hdr, dirs[i].path) : NULL;
+        if (cd && same_stat(&dirs[i], cd) && (uint64_t)cd->first + cd->count <= hdr->nrefs &&
+            cache_bins_valid(hdr, refs + cd->first, cd->count)) {
+            for (uint32_t j = 0; j < cd->count; ++j) {
+                dir_add(&dirs[i], refs[cd->first + j].off, refs[cd->first + j].len);
+            }
+            dirs[i].base = strings;
+            dirs[i].ready = true;
+        } else {
+            stale++;
+        }
+    }
+
+    pthread_t workers[SCAN_THREADS];
+    size_t nworkers = 0;
+    dirs_next = 0;
+    while (nworkers < MIN(stale, SCAN_THREADS) &&
+           pthread_create(&workers[nworkers], NULL, dir_worker, NULL) == 0) {
+        nworkers++;
+    }
+    if (nworkers == 0) dir_worker(NULL);
+
+    for (size_t i = 0; i < ndirs; ++i) {
+        pthread_mutex_lock(&dirs_lock);
+        while (!dirs[i].ready) pthread_cond_wait(&dirs_cond, &dirs_lock);
+        pthread_mutex_unlock(&dirs_lock);
+
+        size_t from = b->top;
+        merge_dir(b, i);
+        post_batch(b, from);
+    }
+
+    for (size_t i = 0; i < nworkers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(b->set);
+    b->set = NULL;
+    b->set_size = 0;
+
+    qsort_r(b->all, b->top, sizeof(bin_t), cmpbins, b->pool);
+    pool_sort(b);
+    write_cache(b);
+    free_dirs();
+
+    pthread_mutex_lock(&scan_lock);
+    unload_cache();
+    pthread_mutex_unlock(&scan_lock);
+}
+
+/* Appends $dir/applications for every directory of a colon separated list. */
+static size_t add_app_dirs(char ***paths, size_t n, const char *list)
+{
+    char *copy = strdup(list);
+    char *save = NULL;
+    for (char *p = strtok_r(copy, ":", &save); p; p = strtok_r(NULL, ":", &save)) {
+        char *path = xrealloc(NULL, strlen(p) + sizeof("/applications"));
+        sprintf(path, "%s/applications", p);
+        *paths = xrealloc(*paths, (n + 1) * sizeof(char *));
+        (*paths)[n++] = path;
+    }
+    free(copy);
+    return n;
+}
+
+static size_t app_dirs(path_dir_t **out)
+{
+    const char *data_home = getenv("XDG_DATA_HOME");
+    const char *data_dirs = getenv("XDG_DATA_DIRS");
+    const char *home = getenv("HOME");
+    char **paths = NULL;
+    size_t n = 0;
+
+    if (data_home && *data_home) {
+        n = add_app_dirs(&paths, n, data_home);
+    } else if (home && *home) {
+        char *local = xrealloc(NULL, strlen(home) + sizeof("/.local/share"));
+        sprintf(local, "%s/.local/share", home);
+        n = add_app_dirs(&paths, n, local);
+        free(local);
+    }
+    n = add_app_dirs(&paths, n, data_dirs && *data_dirs ? data_dirs : "/usr/local/share:/usr/share");
+
+    path_dir_t *list = calloc(n + 1, sizeof(path_dir_t));
+    if (!list) die("Failed to allocate memory\n");
+    for (size_t i = 0; i < n; ++i) {
+        list[i].path = paths[i];
+        stat_dir(&list[i]);
+    }
+    free(paths);
+    *out = list;
+    return n;
+}
+
+/* Undoes the \s, \n, \t, \r and \\ escapes of desktop entry strings in place. */
+static void unescape(char *s)
+{
+    char *out = s;
+    for (; *s; ++s) {
+        if (*s != '\\' || !s[1]) {
+            *out++ = *s;
+            continue;
+        }
+        switch (*++s) {
+        case 's': *out++ = ' '; break;
+        case 'n': *out++ = '\n'; break;
+        case 't': *out++ = '\t'; break;
+        case 'r': *out++ = '\r'; break;
+        case '\\': *out++ = '\\'; break;
+        default:
+            *out++ = '\\';
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+/* Drops the %f, %U, %i and similar field codes, the list is never passed on. */
+static void strip_field_codes(char *s)
+{
+    char *out = s;
+    for (; *s; ++s) {
+        if (*s != '%') {
+            *out++ = *s;
+        } else if (s[1] == '%') {
+            *out++ = *++s;
+        } else if (s[1]) {
+            s++;
+        }
+    }
+    *out = '\0';
+}
+
+typedef struct {
+    char *name;
+    char *exec;
+    bool terminal;
+} app_entry_t;
+
+/* Returns false for anything that is not a visible application. */
+static bool parse_desktop(int dirfd, const char *file, app_entry_t *app)
+{
+    int fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    FILE *f = fstat(fd, &st) == 0 && st.st_size <= APP_FILE_MAX ? fdopen(fd, "r") : NULL;
+    if (!f) {
+        close(fd);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    bool group = false;
+    bool application = false;
+    bool hidden = false;
+
+    memset(app, 0, sizeof(*app));
+    while ((len = getline(&line, &size, f)) > 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+
+        if (line[0] == '[') {
+            if (group) break;
+            group = strcmp(line, "[Desktop Entry]") == 0;
+            continue;
+        }
+
+        char *eq = strchr(line, '=');
+        if (!group || line[0] == '#' || !eq) continue;
+
+        char *end = eq;
+        while (end > line && end[-1] == ' ') end--;
+        *end = '\0';
+        char *value = eq + 1;
+        while (*value == ' ') value++;
+
+        if (strcmp(line, "Name") == 0 && !app->name) {
+            app->name = strdup(value);
+        } else if (strcmp(line, "Exec") == 0 && !app->exec) {
+            app->exec = strdup(value);
+        } else if (strcmp(line, "Type") == 0) {
+            application = strcmp(value, "Application") == 0;
+        } else if (strcmp(line, "Terminal") == 0) {
+            app->terminal = strcmp(value, "true") == 0;
+        } else if (strcmp(line, "NoDisplay") == 0 || strcmp(line, "Hidden") == 0) {
+            hidden |= strcmp(value, "true") == 0;
+        }
+    }
+    free(line);
+    fclose(f);
+
+    if (app->name) unescape(app->name);
+    if (app->exec) {
+        unescape(app->exec);
+        strip_field_codes(app->exec);
+    }
+
+    size_t nlen = app->name ? strlen(app->name) : 0;
+    if (application && !hidden && nlen > 0 && nlen <= UINT16_MAX && app->exec && *app->exec) return true;
+
+    free(app->name);
+    free(app->exec);
+    return false;
+}
+
+typedef struct {
+    char *id;
+    size_t dir;
+} app_file_t;
+
+static int cmpappfiles(const void *p1, const void *p2)
+{
+    const app_file_t *a = p1;
+    const app_file_t *b = p2;
+    int cmp = strcmp(a->id, b->id);
+    if (cmp) return cmp;
+    return (a->dir > b->dir) - (a->dir < b->dir);
+}
+
+static int cmpappentries(const void *p1, const void *p2)
+{
+    return strcmp(((const app_entry_t *)p1)->name, ((const app_entry_t *)p2)->name);
+}
+
+/*
+ * Parses every .desktop file of the applications directories into the
+ * cache layout. A file name found in several directories is taken from the
+ * first, as the spec's desktop file IDs are; subdirectories are not read.
+ */
+static char *build_apps(const path_dir_t *adirs, size_t nadirs, size_t *size)
+{
+    app_file_t *files = NULL;
+    size_t nfiles = 0;
+
+    for (size_t i = 0; i < nadirs; ++i) {
+        DIR *d = opendir(adirs[i].path);
+        if (!d) continue;
+
+        struct dirent *entry;
+        while ((entry = readdir(d)) != NULL) {
+            size_t len = strlen(entry->d_name);
+            if (len <= 8 || strcmp(entry->d_name + len - 8, ".desktop") != 0) continue;
+            if (entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) continue;
+
+            files = xrealloc(files, (nfiles + 1) * sizeof(app_file_t));
+            files[nfiles++] = (app_file_t){strdup(entry->d_name), i};
+        }
+        closedir(d);
+    }
+    if (nfiles) qsort(files, nfiles, sizeof(app_file_t), cmpappfiles);
+
+    app_entry_t *entries = xrealloc(NULL, (nfiles + 1) * sizeof(app_entry_t));
+    size_t nentries = 0;
+    int dirfd = -1;
+    size_t open_dir = SIZE_MAX;
+
+    for (size_t i = 0; i < nfiles; ++i) {
+        if (i > 0 && strcmp(files[i].id, files[i - 1].id) == 0) continue;
+
+        if (files[i].dir != open_dir) {
+            if (dirfd >= 0) close(dirfd);
+            dirfd = open(adirs[files[i].dir].path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            open_dir = files[i].dir;
+        }
+        if (dirfd >= 0 && parse_desktop(dirfd, files[i].id, &entries[nentries])) nentries++;
+    }
+    if (dirfd >= 0) close(dirfd);
+    for (size_t i = 0; i < nfiles; ++i) free(files[i].id);
+    free(files);
+
+    qsort(entries, nentries, sizeof(app_entry_t), cmpappentries);
+
+    size_t strsize = POOL_PAD;
+    for (size_t i = 0; i < nadirs; ++i) strsize += strlen(adirs[i].path) + 1;
+    for (size_t i = 0; i < nentries; ++i) {
+        strsize += strlen(entries[i].name) + strlen(entries[i].exec) + 2;
+    }
+
+    *size = sizeof(apps_header_t) + nadirs * sizeof(cache_dir_t) + nentries * sizeof(app_t) + strsize;
+    char *image = NULL;
+    if (strsize <= UINT32_MAX) image = calloc(1, *size);
+    if (!image) die("Failed to allocate memory\n");
+
+    apps_header_t *hdr = (apps_header_t *)image;
+    cache_dir_t *cdirs = (cache_dir_t *)(hdr + 1);
+    app_t *list = (app_t *)(cdirs + nadirs);
+    char *strings = (char *)(list + nentries);
+    uint32_t off = 0;
+
+    memcpy(hdr->magic, APPS_MAGIC, sizeof(hdr->magic));
+    hdr->ndirs = nadirs;
+    hdr->strsize = strsize;
+
+    for (size_t i = 0; i < nadirs; ++i) {
+        cdirs[i] = (cache_dir_t){
+            .dev = adirs[i].dev,
+            .ino = adirs[i].ino,
+            .mtime_sec = adirs[i].mtime_sec,
+            .mtime_nsec = adirs[i].mtime_nsec,
+            .path = off,
+        };
+        off += sprintf(strings + off, "%s", adirs[i].path) + 1;
+    }
+
+    for (size_t i = 0; i < nentries; ++i) {
+        if (hdr->napps == 0 || strcmp(entries[i].name, strings + list[hdr->napps - 1].name.off) != 0) {
+            app_t *app = &list[hdr->napps++];
+            app->name = (bin_t){off, strlen(entries[i].name), APP_DIR};
+            off += sprintf(strings + off, "%s", entries[i].name) + 1;
+            app->exec = off;
+            off += sprintf(strings + off, "%s", entries[i].exec) + 1;
+            app->terminal = entries[i].terminal;
+        }
+        free(entries[i].name);
+        free(entries[i].exec);
+    }
+    free(entries);
+    return image;
+}
+
+static bool apps_valid(const char *image, size_t size, const path_dir_t *adirs, size_t nadirs)
+{
+    const apps_header_t *hdr = (const apps_header_t *)image;
+    if (size < sizeof(apps_header_t) || memcmp(hdr->magic, APPS_MAGIC, sizeof(hdr->magic)) != 0) return false;
+
+    uint64_t need = sizeof(apps_header_t) + (uint64_t)hdr->ndirs * sizeof(cache_dir_t) +
+                    (uint64_t)hdr->napps * sizeof(app_t) + hdr->strsize;
+    static const char pad[POOL_PAD];
+    if (need != size || hdr->strsize < POOL_PAD || hdr->ndirs != nadirs ||
+        memcmp(image + size - POOL_PAD, pad, POOL_PAD) != 0) {
+        return false;
+    }
+
+    const cache_dir_t *cdirs = (const cache_dir_t *)(hdr + 1);
+    const app_t *list = (const app_t *)(cdirs + hdr->ndirs);
+    const char *strings = image + size - hdr->strsize;
+
+    for (size_t i = 0; i < nadirs; ++i) {
+        if (cdirs[i].path >= hdr->strsize || strcmp(strings + cdirs[i].path, adirs[i].path) != 0 ||
+            !same_stat(&adirs[i], &cdirs[i])) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < hdr->napps; ++i) {
+        if ((uint64_t)list[i].name.off + list[i].name.len >= hdr->strsize) return false;
+        if (strings[list[i].name.off + list[i].name.len] != '\0' || list[i].exec >= hdr->strsize) return false;
+    }
+    return true;
+}
+
+/*
+ * Desktop entries join the store as one batch after the PATH scan. The
+ * cache is used as long as every applications directory has the stat it
+ * was built with, otherwise the entries are parsed again and it is
+ * rewritten.
+ */
+static void scan_apps(void)
+{
+    path_dir_t *adirs;
+    size_t nadirs = app_dirs(&adirs);
+    char path[PATH_MAX];
+    bool have_path = xdg_file(path, sizeof(path), "XDG_CACHE_HOME", ".cache", "apps", false);
+
+    int fd = have_path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED && apps_valid(map, st.st_size, adirs, nadirs)) {
+            apps_image = map;
+            apps_image_size = st.st_size;
+            apps_mapped = true;
+        } else if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+    }
+    if (fd >= 0) close(fd);
+
+    if (!apps_image) {
+        apps_image = build_apps(adirs, nadirs, &apps_image_size);
+        apps_mapped = false;
+
+        char tmp[PATH_MAX + 16];
+        FILE *f = NULL;
+        if (xdg_file(path, sizeof(path), "XDG_CACHE_HOME", ".cache", "apps", true)) {
+            snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+            f = fopen(tmp, "wb");
+        }
+        if (f) {
+            fwrite(apps_image, 1, apps_image_size, f);
+            if (fclose(f) != 0 || rename(tmp, path) != 0) unlink(tmp);
+        }
+    }
+
+    for (size_t i = 0; i < nadirs; ++i) free((char *)adirs[i].path);
+    free(adirs);
+
+    const apps_header_t *hdr = (const apps_header_t *)apps_image;
+    apps = (const app_t *)((const cache_dir_t *)(hdr + 1) + hdr->ndirs);
+    napps = hdr->napps;
+    apps_strings = apps_image + apps_image_size - hdr->strsize;
+    if (napps == 0) return;
+
+    batch_t *batch = calloc(1, sizeof(batch_t));
+    if (!batch) die("Failed to allocate memory\n");
+    batch->pool = (char *)apps_strings;
+    batch->plen = hdr->strsize - POOL_PAD;
+    batch->mapped = true;
+    batch->count = napps;
+    batch->names = xrealloc(NULL, napps * sizeof(bin_t));
+    for (size_t i = 0; i < napps; ++i) batch->names[i] = apps[i].name;
+    scan_post(batch);
+}
+
+/* Returns the command line of a desktop entry, or NULL for a plain bin. */
+static const app_t *find_app(const char *name)
+{
+    size_t lo = 0;
+    size_t hi = napps;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(apps_strings + apps[mid].name.off, name);
+        if (cmp == 0) return &apps[mid];
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+const char *bin_exec(uint32_t i, bool *terminal)
+{
+    if (bins.all[i].dir != APP_DIR) return NULL;
+
+    const app_t *app = find_app(bin_name(i));
+    if (!app) return NULL;
+    *terminal = app->terminal;
+    return apps_strings + app->exec;
+}
+
+static void *scan_thread(void *arg)
+{
+    bins_t b = {0};
+
+    (void)arg;
+    scan_begin = now_ns();
+    scan_path(&b);
+    scan_apps();
+    scan_end = now_ns();
+    if (b.psize) free(b.pool);
+    free(b.all);
+    scan_post(NULL);
+    return NULL;
+}
+
+/*
+ * PATH is scanned in the background while the window comes up. Batches are
+ * queued under scan_lock and every post writes a byte to scan_pipe, which
+ * the event loop polls next to the X connection.
+ */
+static void scan_spawn(void *(*fn)(void *))
+{
+    scan_done = false;
+    if (pipe(scan_pipe) < 0) die("Failed to create pipe\n");
+    for (int i = 0; i < 2; ++i) {
+        fcntl(scan_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(scan_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (pthread_create(&scan_tid, NULL, fn, NULL) != 0) {
+        fn(NULL);
+    } else {
+        pthread_detach(scan_tid);
+    }
+}
+
+void scan_start(void)
+{
+    load_ids();
+    split_path();
+    scan_spawn(scan_thread);
+}
+
+/*
+ * Waits for a PATH scan under way, so the index it writes is complete
+ * before the process exits. stdin may never end and is not waited for.
+ */
+void scan_wait(void)
+{
+    pthread_mutex_lock(&scan_lock);
+    while (!scan_done && !stdin_mode) pthread_cond_wait(&scan_cond, &scan_lock);
+    pthread_mutex_unlock(&scan_lock);
+}
+
+/*
+ * dmenu mode: the candidates are the lines of stdin, in input order and
+ * with duplicates. A regular file is mapped behind an anonymous
+ * reservation, which supplies the POOL_PAD zero bytes, and serves as the
+ * pool as is. Anything else is read in chunks that are handed over as one
+ * batch each. Names end with '\n' instead of a zero byte here, only len
+ * delimits them. Lines longer than UINT16_MAX are cut.
+ */
+static void post_lines(char *pool, size_t plen, bool mapped, size_t from, size_t to)
+{
+    batch_t *batch = calloc(1, sizeof(batch_t));
+    size_t size = 0;
+    if (!batch) die("Failed to allocate memory\n");
+
+    for (size_t i = from; i < to; ) {
+        const char *nl = memchr(pool + i, '\n', to - i);
+        size_t end = nl ? (size_t)(nl - pool) : to;
+
+        if (end > i) {
+            if (batch->count == size) {
+                size = size ? size * 2 : 1024;
+                batch->names = xrealloc(batch->names, size * sizeof(bin_t));
+            }
+            batch->names[batch->count++] = (bin_t){i, MIN(end - i, UINT16_MAX), NO_DIR};
+        }
+        i = end + 1;
+    }
+
+    batch->pool = pool;
+    batch->plen = plen;
+    batch->mapped = mapped;
+    scan_post(batch);
+}
+
+static bool stdin_map_file(off_t size)
+{
+    if (size <= 0 || lseek(STDIN_FILENO, 0, SEEK_CUR) != 0) return false;
+
+    size_t len = MIN((uint64_t)size, UINT32_MAX - POOL_PAD);
+    char *map = mmap(NULL, len + POOL_PAD, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return false;
+
+    if (mmap(map, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, STDIN_FILENO, 0) == MAP_FAILED) {
+        munmap(map, len + POOL_PAD);
+        return false;
+    }
+    stdin_map = map;
+    stdin_size = len + POOL_PAD;
+
+    for (size_t from = 0; from < len; ) {
+        size_t to = MIN(from + STDIN_CHUNK, len);
+        const char *nl = to < len ? memchr(map + to, '\n', len - to) : NULL;
+        to = nl ? (size_t)(nl - map) + 1 : len;
+        post_lines(map, len, true, from, to);
+        from = to;
+    }
+    return true;
+}
+
+static void stdin_stream(void)
+{
+    size_t size = STDIN_CHUNK;
+    size_t len = 0;
+    char *buf = xrealloc(NULL, size);
+
+    for (;;) {
+        if (len == size) {
+            size *= 2;
+            buf = xrealloc(buf, size);
+        }
+
+        ssize_t n = read(STDIN_FILENO, buf + len, size - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+
+        const char *nl = memrchr(buf, '\n', len);
+        if (!nl) continue;
+
+        size_t done = nl - buf + 1;
+        char *next = xrealloc(NULL, size);
+        memcpy(next, buf + done, len - done);
+        post_lines(buf, done, false, 0, done);
+        buf = next;
+        len -= done;
+    }
+
+    if (len) {
+        post_lines(buf, len, false, 0, len);
+    } else {
+        free(buf);
+    }
+}
+
+static void *stdin_thread(void *arg)
+{
+    struct stat st;
+
+    (void)arg;
+    scan_begin = now_ns();
+    if (fstat(STDIN_FILENO, &st) < 0 || !S_ISREG(st.st_mode) || !stdin_map_file(st.st_size)) {
+        stdin_stream();
+    }
+    scan_end = now_ns();
+    scan_post(NULL);
+    return NULL;
+}
+
+void stdin_start(void)
+{
+    stdin_mode = true;
+    scan_spawn(stdin_thread);
+}
+
+/* Called whenever bins.all is reordered, a build under way is thrown away once it is done. */
+static void trigrams_invalidate(void)
+{
+    trigrams_valid = false;
+    trigrams_stale = true;
+}
+
+/* Merges a sorted batch into the sorted bin list. */
+static void bins_merge_batch(batch_t *batch)
+{
+    if (bins.top == 0 && batch->mapped) {
+        bins_reserve(&bins, batch->count);
+        memcpy(bins.all, batch->names, batch->count * sizeof(bin_t));
+        bins.top = batch->count;
+        bins.pool = batch->pool;
+        bins.plen = batch->plen;
+        return;
+    }
+
+    pool_reserve(&bins, batch->plen);
+    uint32_t base = bins.plen;
+    memcpy(bins.pool + base, batch->pool, batch->plen);
+    bins.plen += batch->plen;
+    memset(bins.pool + bins.plen, 0, POOL_PAD);
+
+    bin_t *merged = malloc((bins.top + batch->count) * sizeof(bin_t));
+    if (!merged) die("Failed to allocate memory\n");
+
+    size_t i = 0;
+    size_t j = 0;
+    size_t n = 0;
+    while (i < bins.top || j < batch->count) {
+        int cmp = j == batch->count ? -1 :
+                  i == bins.top ? 1 :
+                  strcmp(bin_name(i), bins.pool + base + batch->names[j].off);
+        if (cmp <= 0) {
+            if (cmp == 0) j++;
+            merged[n++] = bins.all[i++];
+        } else {
+            merged[n] = batch->names[j++];
+            merged[n++].off += base;
+        }
+    }
+
+    free(bins.all);
+    bins.all = merged;
+    bins.top = n;
+    bins.size = n;
+}
+
+/* dmenu batches keep their input order and are appended as they come. */
+static void bins_append_batch(batch_t *batch)
+{
+    uint32_t base = 0;
+
+    if (batch->mapped) {
+        bins.pool = batch->pool;
+        bins.plen = batch->plen;
+    } else {
+        if (bins.plen + batch->plen > UINT32_MAX - POOL_PAD) return;
+        pool_reserve(&bins, batch->plen);
+        base = bins.plen;
+        memcpy(bins.pool + base, batch->pool, batch->plen);
+        bins.plen += batch->plen;
+        memset(bins.pool + bins.plen, 0, POOL_PAD);
+    }
+
+    bins_reserve(&bins, bins.top + batch->count);
+    for (size_t i = 0; i < batch->count; ++i) {
+        bins.all[bins.top] = batch->names[i];
+        bins.all[bins.top++].off += base;
+    }
+}
+
+/* Returns true when the bin list changed. */
+bool scan_collect(void)
+{
+    char buf[64];
+    while (read(scan_pipe[0], buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&scan_lock);
+    batch_t *batch = scan_head;
+    bool done = scan_done;
+    scan_head = scan_tail = NULL;
+    pthread_mutex_unlock(&scan_lock);
+
+    bool changed = batch != NULL;
+    if (changed && !stdin_mode) trigrams_invalidate();
+    while (batch) {
+        batch_t *next = batch->next;
+        if (stdin_mode) {
+            bins_append_batch(batch);
+        } else {
+            bins_merge_batch(batch);
+        }
+        if (!batch->mapped) free(batch->pool);
+        free(batch->names);
+        free(batch);
+        batch = next;
+    }
+
+    if (done) {
+        if (bins.psize && !stdin_mode) pool_sort(&bins);
+        close(scan_pipe[0]);
+        close(scan_pipe[1]);
+        scan_pipe[0] = scan_pipe[1] = -1;
+    }
+
+    return changed;
+}
+
+/*
+ * Substring kernels. s may be read up to POOL_PAD bytes past s + n, which
+ * every pool guarantees. The vector versions compare the first and last byte
+ * of q against a whole block of candidate positions at once and only memcmp
+ * the middle of q where both hit.
+ */
+static bool match_scalar(const char *s, size_t n, const char *q, size_t k)
+{
+    if (k == 0) return true;
+    if (k > n) return false;
+
+    const char *end = s + n - k + 1;
+    for (const char *p = s; p < end; ++p) {
+        p = memchr(p, q[0], end - p);
+        if (!p) return false;
+        if (memcmp(p + 1, q + 1, k - 1) == 0) return true;
+    }
+    return false;
+}
+
+#ifdef HAVE_SSE2
+static bool match_sse2(const char *s, size_t n, const char *q, size_t k)
+{
+    if (k == 0) return true;
+    if (k > n) return false;
+
+    const __m128i first = _mm_set1_epi8(q[0]);
+    const __m128i last = _mm_set1_epi8(q[k - 1]);
+
+    for (size_t i = 0; i + k <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + k - 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+        size_t left = n - k - i + 1;
+        if (left < 16) mask &= (1u << left) - 1;
+
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (k < 3 || memcmp(s + i + bit + 1, q + 1, k - 2) == 0) return true;
+            mask &= mask - 1;
+        }
+    }
+    return false;
+}
+
+__attribute__((target("avx2")))
+static bool match_avx2(const char *s, size_t n, const char *q, size_t k)
+{
+    if (k == 0) return true;
+    if (k > n) return false;
+
+    const __m256i first = _mm256_set1_epi8(q[0]);
+    const __m256i last = _mm256_set1_epi8(q[k - 1]);
+
+    for (size_t i = 0; i + k <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + i + k - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+        size_t left = n - k - i + 1;
+        if (left < 32) mask &= (1u << left) - 1;
+
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (k < 3 || memcmp(s + i + bit + 1, q + 1, k - 2) == 0) return true;
+            mask &= mask - 1;
+        }
+    }
+    return false;
+}
+#endif
+
+static bool (*match)(const char *s, size_t n, const char *q, size_t k) = match_scalar;
+
+void match_init(void)
+{
+#ifdef HAVE_SSE2
+    __builtin_cpu_init();
+    match = __builtin_cpu_supports("avx2") ? match_avx2 : match_sse2;
+#endif
+}
+
+static uint32_t check_rand(uint64_t *rng)
+{
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return *rng >> 32;
+}
+
+/*
+ * Cross-checks every kernel this CPU runs against memmem() on random
+ * strings over a small alphabet, so partial hits are common. Lengths cross
+ * the 16 and 32 byte blocks and the bytes past n are garbage, as the next
+ * names of a pool are. Returns the number of mismatches.
+ */
+size_t match_check(size_t cases)
+{
+    static const char alphabet[] = "aab-";
+    bool (*kernels[3])(const char *, size_t, const char *, size_t) = {match_scalar};
+    size_t nkernels = 1;
+    char s[3 * 32 + 2 * POOL_PAD];
+    char q[2 * 32 + 3];
+    uint64_t rng = 0x9e3779b97f4a7c15u;
+    size_t failed = 0;
+
+#ifdef HAVE_SSE2
+    __builtin_cpu_init();
+    kernels[nkernels++] = match_sse2;
+    if (__builtin_cpu_supports("avx2")) kernels[nkernels++] = match_avx2;
+#endif
+
+    for (size_t c = 0; c < cases; ++c) {
+        size_t start = check_rand(&rng) % POOL_PAD;
+        size_t n = check_rand(&rng) % (3 * 32 + 1);
+        size_t k = check_rand(&rng) % (MIN(n, 2 * 32) + 3);
+
+        for (size_t i = 0; i < sizeof(s); ++i) {
+            s[i] = alphabet[check_rand(&rng) % (sizeof(alphabet) - 1)];
+        }
+        if (k <= n && check_rand(&rng) % 2) {
+            memcpy(q, s + start + check_rand(&rng) % (n - k + 1), k);
+        } else {
+            for (size_t i = 0; i < k; ++i) q[i] = alphabet[check_rand(&rng) % (sizeof(alphabet) - 1)];
+        }
+        q[k] = '\0';
+
+        bool want = k == 0 || memmem(s + start, n, q, k) != NULL;
+        for (size_t i = 0; i < nkernels; ++i) {
+            if (kernels[i](s + start, n, q, k) == want) continue;
+            fprintf(stderr, "kernel %zu: \"%s\" in \"%.*s\" should be %s\n", i, q, (int)n, s + start, want ? "found" : "missing");
+            failed++;
+        }
+    }
+    return failed;
+}
+
+static inline uint32_t trigram_key(const char *s)
+{
+    return (uint32_t)(unsigned char)s[0] << 16 |
+           (uint32_t)(unsigned char)s[1] << 8 |
+           (uint32_t)(unsigned char)s[2];
+}
+
+static int cmpu64(const void *p1, const void *p2)
+{
+    uint64_t a = *(const uint64_t *)p1;
+    uint64_t b = *(const uint64_t *)p2;
+    return (a > b) - (a < b);
+}
+
+static void trigrams_free(trigrams_t *t)
+{
+    free(t->keys);
+    free(t->starts);
+    free(t->postings);
+    memset(t, 0, sizeof(trigrams_t));
+}
+
+/*
+ * Indexes bins [base->count, count), whose names are names[0..), and
+ * merges them into base. The new bins are above every bin of base, so they
+ * go to the end of each posting list. Long dmenu lists would need a huge
+ * index, those are filtered by scanning.
+ */
+static void trigrams_build(trigrams_t *t, const trigrams_t *base, const bin_t *names, const char *pool, size_t count)
+{
+    size_t from = base->count;
+    size_t nbase = base->nkeys ? base->starts[base->nkeys] : 0;
+    size_t npairs = 0;
+    for (size_t i = from; i < count; ++i) {
+        if (names[i - from].len >= 3) npairs += names[i - from].len - 2;
+    }
+
+    t->count = count;
+    t->disabled = base->disabled || nbase + npairs > TRIGRAM_MAX_PAIRS;
+    if (t->disabled) return;
+
+    uint64_t *pairs = malloc((npairs + 1) * sizeof(uint64_t));
+    if (!pairs) die("Failed to allocate memory\n");
+
+    size_t n = 0;
+    for (size_t i = from; i < count; ++i) {
+        const char *name = pool + names[i - from].off;
+        for (uint32_t j = 0; j + 3 <= names[i - from].len; ++j) {
+            pairs[n++] = (uint64_t)trigram_key(name + j) << 32 | i;
+        }
+    }
+    qsort(pairs, n, sizeof(uint64_t), cmpu64);
+
+    t->keys = xrealloc(NULL, (base->nkeys + n + 1) * sizeof(uint32_t));
+    t->starts = xrealloc(NULL, (base->nkeys + n + 1) * sizeof(uint32_t));
+    t->postings = xrealloc(NULL, (nbase + n + 1) * sizeof(uint32_t));
+
+    size_t k = 0;
+    size_t p = 0;
+    size_t b = 0;
+    size_t i = 0;
+    while (b < base->nkeys || i < n) {
+        uint32_t key = i == n || (b < base->nkeys && base->keys[b] < pairs[i] >> 32) ?
+                       base->keys[b] : (uint32_t)(pairs[i] >> 32);
+        t->keys[k] = key;
+        t->starts[k++] = p;
+
+        if (b < base->nkeys && base->keys[b] == key) {
+            size_t len = base->starts[b + 1] - base->starts[b];
+            memcpy(t->postings + p, base->postings + base->starts[b], len * sizeof(uint32_t));
+            p += len;
+            b++;
+        }
+        for (; i < n && pairs[i] >> 32 == key; ++i) {
+            if (i == 0 || pairs[i] != pairs[i - 1]) t->postings[p++] = (uint32_t)pairs[i];
+        }
+    }
+    t->starts[k] = p;
+    t->nkeys = k;
+    t->keys = xrealloc(t->keys, (k + 1) * sizeof(uint32_t));
+    t->starts = xrealloc(t->starts, (k + 1) * sizeof(uint32_t));
+    t->postings = xrealloc(t->postings, (p + 1) * sizeof(uint32_t));
+
+    free(pairs);
+}
+
+static void *trigram_thread(void *arg)
+{
+    size_t count = (size_t)arg;
+
+    trigrams_build(&trigram_result, &trigrams, trigram_names, trigram_pool, count);
+    free(trigram_names);
+    free(trigram_pool);
+
+    pthread_mutex_lock(&trigram_lock);
+    trigram_building = false;
+    trigram_done = true;
+    pthread_cond_broadcast(&trigram_cond);
+    pthread_mutex_unlock(&trigram_lock);
+    return NULL;
+}
+
+/*
+ * Sorting the trigrams of a few hundred thousand names takes about a
+ * second, so the index is built on a thread of its own from a copy of the
+ * names and substring queries are answered by the kernels until it is
+ * ready. A finished build is picked up here, and the next one started once
+ * the list changed. Bins appended by a dmenu batch extend the index, only
+ * a reordered list is indexed from scratch. The PATH scan is waited for,
+ * every batch it merges shifts the bins.
+ */
+static void trigrams_update(void)
+{
+    pthread_mutex_lock(&trigram_lock);
+    bool building = trigram_building;
+    bool done = trigram_done;
+    trigram_done = false;
+    pthread_mutex_unlock(&trigram_lock);
+    if (building) return;
+
+    if (done && !trigrams_stale) {
+        trigrams_free(&trigrams);
+        trigrams = trigram_result;
+        trigrams_valid = true;
+        memset(&trigram_result, 0, sizeof(trigram_result));
+    } else if (done) {
+        trigrams_free(&trigram_result);
+    }
+    if (trigrams_valid && (trigrams.disabled || trigrams.count == bins.top)) return;
+    if (bins.top == 0 || (!stdin_mode && scan_pipe[0] >= 0)) return;
+    if (!trigrams_valid) trigrams_free(&trigrams);
+
+    size_t from = trigrams.count;
+    size_t plen = 0;
+    for (size_t i = from; i < bins.top; ++i) plen += bins.all[i].len;
+    trigram_names = xrealloc(NULL, (bins.top - from) * sizeof(bin_t));
+    trigram_pool = xrealloc(NULL, plen + 1);
+
+    plen = 0;
+    for (size_t i = from; i < bins.top; ++i) {
+        memcpy(trigram_pool + plen, bin_name(i), bins.all[i].len);
+        trigram_names[i - from] = (bin_t){plen, bins.all[i].len, bins.all[i].dir};
+        plen += bins.all[i].len;
+    }
+
+    trigrams_stale = false;
+    trigram_building = true;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, trigram_thread, (void *)bins.top) != 0) {
+        trigram_thread((void *)bins.top);
+    } else {
+        pthread_detach(tid);
+    }
+}
+
+/* Waits for a build under way and drops the index. */
+static void trigrams_cleanup(void)
+{
+    pthread_mutex_lock(&trigram_lock);
+    while (trigram_building) pthread_cond_wait(&trigram_cond, &trigram_lock);
+    trigram_done = false;
+    pthread_mutex_unlock(&trigram_lock);
+
+    trigrams_free(&trigrams);
+    trigrams_free(&trigram_result);
+    trigrams_valid = false;
+    trigrams_stale = false;
+}
+
+static const uint32_t *trigram_list(uint32_t key, size_t *n)
+{
+    size_t lo = 0;
+    size_t hi = trigrams.nkeys;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (trigrams.keys[mid] == key) {
+            *n = trigrams.starts[mid + 1] - trigrams.starts[mid];
+            return trigrams.postings + trigrams.starts[mid];
+        }
+        if (trigrams.keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *n = 0;
+    return NULL;
+}
+
+/*
+ * Writes the bins containing every trigram of q to out, which must hold
+ * limit entries. Bins appended since the index was built are passed on as
+ * they are. Returns SIZE_MAX without touching out when even the shortest
+ * posting list and those are not below limit and scanning is as cheap.
+ */
+static size_t trigram_candidates(const char *q, size_t k, size_t limit, uint32_t *out)
+{
+    if (!trigrams_valid || trigrams.disabled) return SIZE_MAX;
+
+    size_t best = SIZE_MAX;
+    const uint32_t *list = NULL;
+    for (size_t i = 0; i + 3 <= k; ++i) {
+        size_t n;
+        const uint32_t *l = trigram_list(trigram_key(q + i), &n);
+        if (n < best) {
+            best = n;
+            list = l;
+        }
+        if (n == 0) break;
+    }
+    if (best + bins.top - trigrams.count >= limit) return SIZE_MAX;
+
+    if (best) memcpy(out, list, best * sizeof(uint32_t));
+    size_t count = best;
+
+    for (size_t i = 0; i + 3 <= k && count > 0; ++i) {
+        size_t n;
+        const uint32_t *l = trigram_list(trigram_key(q + i), &n);
+        if (l == list) continue;
+
+        size_t a = 0;
+        size_t b = 0;
+        size_t kept = 0;
+        while (a < count && b < n) {
+            if (out[a] < l[b]) {
+                a++;
+            } else if (out[a] > l[b]) {
+                b++;
+            } else {
+                out[kept++] = out[a++];
+                b++;
+            }
+        }
+        count = kept;
+    }
+
+    for (size_t i = trigrams.count; i < bins.top; ++i) out[count++] = i;
+    return count;
+}
+
+static inline bool char_eq(char a, char b, bool icase)
+{
+    return a == b || (icase && tolower((unsigned char)a) == tolower((unsigned char)b));
+}
+
+static bool match_fuzzy(const char *s, size_t n, const char *q, size_t k, bool icase)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < n && j < k; ++i) {
+        if (char_eq(s[i], q[j], icase)) j++;
+    }
+    return j == k;
+}
+
+static bool is_boundary(const char *s, size_t i)
+{
+    if (i == 0) return true;
+
+    unsigned char p = s[i - 1];
+    unsigned char ch = s[i];
+    return p == '-' || p == '_' || p == '.' || p == ' ' || p == '/' ||
+           (islower(p) && isupper(ch)) || (isalpha(p) && isdigit(ch));
+}
+
+/* Scores q matched left to right inside s[start..end). */
+static int score_window(const char *s, size_t start, size_t end, const char *q, size_t k, bool icase)
+{
+    int score = start == 0 ? BONUS_PREFIX : 0;
+    int consecutive = 0;
+    bool gap = false;
+    size_t j = 0;
+
+    for (size_t i = start; i < end; ++i) {
+        if (j < k && char_eq(s[i], q[j], icase)) {
+            int bonus = is_boundary(s, i) ? BONUS_BOUNDARY : 0;
+            if (consecutive) bonus = MAX(bonus, BONUS_CONSECUTIVE);
+            if (j == 0) bonus *= 2;
+            score += SCORE_MATCH + bonus;
+            consecutive++;
+            gap = false;
+            j++;
+        } else {
+            score += gap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+            consecutive = 0;
+            gap = true;
+        }
+    }
+    return score;
+}
+
+/*
+ * Fuzzy matches are scored over the shortest window ending at the leftmost
+ * complete match, found by walking back from it as fzf v1 does. Substring
+ * matches are scored at their first occurrence.
+ */
+static int score_bin(uint32_t bin, const char *q, size_t k)
+{
+    const char *s = bin_name(bin);
+    size_t n = bins.all[bin].len;
+
+    if (filter_fuzzy) {
+        size_t end = 0;
+        for (size_t j = 0; end < n && j < k; ++end) {
+            if (char_eq(s[end], q[j], filter_icase)) j++;
+        }
+
+        size_t start = end;
+        for (size_t j = k; j > 0; ) {
+            if (char_eq(s[--start], q[j - 1], filter_icase)) j--;
+        }
+        return score_window(s, start, end, q, k, filter_icase);
+    }
+
+    for (size_t i = 0; i + k <= n; ++i) {
+        if (memcmp(s + i, q, k) == 0) return score_window(s, i, i + k, q, k, false);
+    }
+    return 0;
+}
+
+static bool rank_better(const rank_t *a, const rank_t *b)
+{
+    if (a->score != b->score) return a->score > b->score;
+    if (a->len != b->len) return a->len < b->len;
+    return a->pos < b->pos;
+}
+
+static int cmpranks(const void *p1, const void *p2)
+{
+    return rank_better(p1, p2) ? -1 : 1;
+}
+
+static int cmppos(const void *p1, const void *p2)
+{
+    const rank_t *a = p1;
+    const rank_t *b = p2;
+    return (a->pos > b->pos) - (a->pos < b->pos);
+}
+
+static void heap_sift_down(rank_t *h, size_t n, size_t i)
+{
+    for (;;) {
+        size_t worst = i;
+        size_t l = 2 * i + 1;
+        size_t r = l + 1;
+        if (l < n && rank_better(&h[worst], &h[l])) worst = l;
+        if (r < n && rank_better(&h[worst], &h[r])) worst = r;
+        if (worst == i) return;
+
+        rank_t tmp = h[i];
+        h[i] = h[worst];
+        h[worst] = tmp;
+        i = worst;
+    }
+}
+
+static void heap_push(rank_t *h, size_t n, rank_t r)
+{
+    size_t i = n;
+    h[i] = r;
+    while (i > 0 && rank_better(&h[(i - 1) / 2], &h[i])) {
+        rank_t tmp = h[i];
+        h[i] = h[(i - 1) / 2];
+        h[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
+
+static bool history_file(char *buf, size_t size, bool create)
+{
+    return xdg_file(buf, size, "XDG_STATE_HOME", ".local/state", "history", create);
+}
+
+/* Replaces the history in memory with the file, which is left alone when invalid. */
+void history_load(void)
+{
+    char path[PATH_MAX];
+    nhistory = 0;
+    boosts_built = false;
+    if (!history_file(path, sizeof(path), false)) return;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(history_header_t)) {
+        close(fd);
+        return;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    const history_header_t *hdr = map;
+    const history_entry_t *entries = (const history_entry_t *)(hdr + 1);
+    if (memcmp(hdr->magic, HISTORY_MAGIC, sizeof(hdr->magic)) == 0 && hdr->count <= HISTORY_ENTRIES &&
+        sizeof(history_header_t) + hdr->count * sizeof(history_entry_t) == (size_t)st.st_size) {
+        for (uint32_t i = 0; i < hdr->count; ++i) {
+            if (!memchr(entries[i].name, '\0', sizeof(entries[i].name)) || entries[i].count == 0) continue;
+            history[nhistory++] = entries[i];
+        }
+    }
+    munmap(map, st.st_size);
+}
+
+static void history_save(void)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 16];
+    if (!history_file(path, sizeof(path), true)) return;
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return;
+
+    history_header_t hdr = {0};
+    memcpy(hdr.magic, HISTORY_MAGIC, sizeof(hdr.magic));
+    hdr.count = nhistory;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(history, sizeof(history_entry_t), nhistory, f);
+
+    if (fclose(f) != 0 || rename(tmp, path) != 0) unlink(tmp);
+}
+
+/* Launch count weighted by how recently the name was last launched. */
+static uint64_t frecency(const history_entry_t *e, int64_t now)
+{
+    int64_t age = now - e->last;
+    unsigned weight = age < 3600 ? 16 : age < 86400 ? 8 : age < 7 * 86400 ? 2 : 1;
+    return (uint64_t)e->count * weight;
+}
+
+/* The file is read again first, so launches from other instances are kept. */
+void history_record(const char *name)
+{
+    size_t len = strlen(name);
+    if (stdin_mode || len == 0 || len >= sizeof(history[0].name)) return;
+
+    history_load();
+    int64_t now = time(NULL);
+
+    size_t i = 0;
+    while (i < nhistory && strcmp(history[i].name, name) != 0) i++;
+
+    if (i == nhistory && nhistory == HISTORY_ENTRIES) {
+        i = 0;
+        for (size_t j = 1; j < nhistory; ++j) {
+            if (frecency(&history[j], now) < frecency(&history[i], now)) i = j;
+        }
+        memset(&history[i], 0, sizeof(history[i]));
+    } else if (i == nhistory) {
+        memset(&history[nhistory++], 0, sizeof(history[i]));
+    }
+
+    memcpy(history[i].name, name, len + 1);
+    history[i].count++;
+    history[i].last = now;
+
+    uint64_t total = 0;
+    for (size_t j = 0; j < nhistory; ++j) total += history[j].count;
+
+    if (total > HISTORY_AGING) {
+        size_t kept = 0;
+        for (size_t j = 0; j < nhistory; ++j) {
+            history[j].count = history[j].count * 9 / 10;
+            if (history[j].count) history[kept++] = history[j];
+        }
+        nhistory = kept;
+    }
+
+    history_save();
+}
+
+static int cmpboosts(const void *p1, const void *p2)
+{
+    const boost_t *a = p1;
+    const boost_t *b = p2;
+    return (a->bin > b->bin) - (a->bin < b->bin);
+}
+
+/* The bonus grows with the log of the frecency, a few matched characters' worth per doubling. */
+static void boosts_build(void)
+{
+    int64_t now = time(NULL);
+
+    nboosts = 0;
+    boosts_built = true;
+    if (stdin_mode) return;
+
+    for (size_t i = 0; i < nhistory; ++i) {
+        ssize_t bin = bins_find(history[i].name);
+        if (bin < 0) continue;
+
+        uint64_t f = frecency(&history[i], now);
+        boosts[nboosts++] = (boost_t){bin, HISTORY_BONUS * (63 - __builtin_clzll(f + 1))};
+    }
+    qsort(boosts, nboosts, sizeof(boost_t), cmpboosts);
+}
+
+static int history_bonus(uint32_t bin)
+{
+    size_t lo = 0;
+    size_t hi = nboosts;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (boosts[mid].bin == bin) return boosts[mid].bonus;
+        if (boosts[mid].bin < bin) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return 0;
+}
+
+/* Keeps r if it is among the filter_keep best seen so far. */
+static void heap_offer(rank_t *h, size_t *n, rank_t r)
+{
+    if (*n < filter_keep) {
+        heap_push(h, (*n)++, r);
+    } else if (rank_better(&r, &h[0])) {
+        h[0] = r;
+        heap_sift_down(h, *n, 0);
+    }
+}
+
+static void *filter_worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (pool_next >= pool_nchunks) pthread_cond_wait(&pool_work, &pool_lock);
+
+        size_t chunk = pool_next++;
+        void (*fn)(size_t) = pool_fn;
+        pthread_mutex_unlock(&pool_lock);
+        fn(chunk);
+        pthread_mutex_lock(&pool_lock);
+        if (++pool_finished == pool_next) pthread_cond_signal(&pool_idle);
+    }
+    return NULL;
+}
+
+static void pool_start(void)
+{
+    if (pool_started) return;
+    pool_started = true;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n = cpus > 1 ? MIN((size_t)cpus, FILTER_THREADS) - 1 : 0;
+    for (size_t i = 0; i < n; ++i) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, filter_worker, NULL) != 0) break;
+        pthread_detach(tid);
+    }
+}
+
+/*
+ * Runs fn over chunks [0, nchunks) and waits for all of them. interrupt is
+ * polled on this thread between chunks, once it returns true no more chunks
+ * are handed out. Returns the number of chunks run, always a prefix.
+ */
+static size_t filter_run(void (*fn)(size_t), size_t nchunks, bool (*interrupt)(void))
+{
+    if (nchunks > 1) pool_start();
+
+    pthread_mutex_lock(&pool_lock);
+    pool_fn = fn;
+    pool_nchunks = nchunks;
+    pool_next = 0;
+    pool_finished = 0;
+    if (nchunks > 1) pthread_cond_broadcast(&pool_work);
+
+    while (pool_next < pool_nchunks) {
+        size_t chunk = pool_next++;
+        pthread_mutex_unlock(&pool_lock);
+        fn(chunk);
+        pthread_mutex_lock(&pool_lock);
+        pool_finished++;
+
+        if (interrupt && pool_next < pool_nchunks && interrupt()) pool_nchunks = pool_next;
+    }
+
+    while (pool_finished < pool_next) pthread_cond_wait(&pool_idle, &pool_lock);
+    size_t run = pool_next;
+    pthread_mutex_unlock(&pool_lock);
+    return run;
+}
+
+/* Sizes the per-chunk results for n items and returns the number of chunks. */
+static size_t chunks_reserve(size_t n, size_t keep)
+{
+    size_t nchunks = (n + FILTER_CHUNK - 1) / FILTER_CHUNK;
+
+    if (chunk_counts_size < nchunks) {
+        chunk_counts_size = nchunks;
+        chunk_counts = xrealloc(chunk_counts, nchunks * sizeof(size_t));
+    }
+    if (chunk_heaps_size < nchunks * keep) {
+        chunk_heaps_size = nchunks * keep;
+        chunk_heaps = xrealloc(chunk_heaps, chunk_heaps_size * sizeof(rank_t));
+    }
+    return nchunks;
+}
+
+/* Matches of a chunk are written over the start of its own slice of job.items. */
+static void match_chunk(size_t chunk)
+{
+    size_t start = chunk * FILTER_CHUNK;
+    size_t end = MIN(start + FILTER_CHUNK, job.n);
+    uint32_t *out = job.items + start;
+    size_t count = 0;
+
+    for (size_t i = start; i < end; ++i) {
+        uint32_t bin = job.from ? job.from[i] : job.base + i;
+        bool hit = filter_fuzzy ?
+            match_fuzzy(bin_name(bin), bins.all[bin].len, job.q, job.k, job.icase) :
+            match(bin_name(bin), bins.all[bin].len, job.q, job.k);
+        if (hit) out[count++] = bin;
+    }
+    chunk_counts[chunk] = count;
+}
+
+static void rank_chunk(size_t chunk)
+{
+    chunk += job.first;
+    size_t start = chunk * FILTER_CHUNK;
+    size_t end = MIN(start + FILTER_CHUNK, job.n);
+    rank_t *h = chunk_heaps + chunk * filter_keep;
+    size_t n = 0;
+
+    for (size_t i = start; i < end; ++i) {
+        uint32_t bin = job.items[i];
+        int bonus = nboosts ? history_bonus(bin) : 0;
+        if (job.k == 0 && bonus == 0) continue;
+
+        int score = job.k ? score_bin(bin, job.q, job.k) : 0;
+        heap_offer(h, &n, (rank_t){score + bonus, bins.all[bin].len, i});
+    }
+    chunk_counts[chunk] = n;
+}
+
+/*
+ * Moves the filter_keep best scored matches to the front, best first,
+ * using a min-heap whose root is the worst of the kept candidates. Every
+ * chunk keeps its own best and those are merged here; ties are broken by
+ * position, so the result does not depend on the order chunks finish in.
+ * Names from the launch history get a frecency bonus on top of their match
+ * score; with an empty query only those are moved up. The rest keep their
+ * alphabetical order, so the full match set is never sorted. An
+ * interrupted call returns false and the next one resumes after the
+ * ranked_chunks chunks that were done.
+ */
+static bool rank_bins(filter_level_t *level, const char *q, size_t k, bool (*interrupt)(void))
+{
+    if (!boosts_built) boosts_build();
+
+    if ((k == 0 && nboosts == 0) || level->count < 2 || filter_keep == 0) {
+        bins.drawable = level->items;
+        return true;
+    }
+
+    if (ranked_size < level->count) {
+        ranked_size = level->count;
+        ranked = xrealloc(ranked, ranked_size * sizeof(uint32_t));
+    }
+
+    if (heap_size < filter_keep) {
+        heap_size = filter_keep;
+        heap = xrealloc(heap, heap_size * sizeof(rank_t));
+    }
+
+    job.items = level->items;
+    job.n = level->count;
+    job.first = ranked_chunks;
+    job.q = q;
+    job.k = k;
+    size_t nchunks = chunks_reserve(level->count, filter_keep);
+    ranked_chunks += filter_run(rank_chunk, nchunks - ranked_chunks, interrupt);
+    if (ranked_chunks < nchunks) return false;
+
+    size_t nheap = 0;
+    for (size_t c = 0; c < nchunks; ++c) {
+        for (size_t i = 0; i < chunk_counts[c]; ++i) {
+            heap_offer(heap, &nheap, chunk_heaps[c * filter_keep + i]);
+        }
+    }
+
+    qsort(heap, nheap, sizeof(rank_t), cmpranks);
+    for (size_t i = 0; i < nheap; ++i) {
+        ranked[i] = level->items[heap[i].pos];
+    }
+
+    qsort(heap, nheap, sizeof(rank_t), cmppos);
+    size_t top = nheap;
+    size_t h = 0;
+    for (size_t i = 0; i < level->count; ++i) {
+        if (h < nheap && heap[h].pos == i) {
+            h++;
+            continue;
+        }
+        ranked[top++] = level->items[i];
+    }
+
+    bins.drawable = ranked;
+    return true;
+}
+
+/*
+ * After the first scan the PATH directories are watched with inotify and
+ * every create, delete, rename or mode change is applied to the sorted list
+ * in place. Events that arrive during the scan stay queued in the kernel
+ * until it is done, so they never race with its batches. The on-disk index
+ * needs no update for the first three: the touched directory's mtime
+ * changed, so the next cold start rescans just that directory. A chmod
+ * leaves the mtime alone, so an index it makes stale is removed.
+ */
+void watch_start(void)
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) return;
+
+    watches = xrealloc(watches, (npath_dirs + 1) * sizeof(int));
+    for (size_t i = 0; i < npath_dirs; ++i) {
+        watches[i] = inotify_add_watch(inotify_fd, path_dirs[i], IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+    }
+}
+
+/* Returns the first PATH directory holding name as an executable, or NO_DIR. */
+static uint16_t on_path(const char *name)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    for (size_t i = 0; i < npath_dirs; ++i) {
+        int n = snprintf(path, sizeof(path), "%s/%s", path_dirs[i], name);
+        if (n < 0 || (size_t)n >= sizeof(path)) continue;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && faccessat(AT_FDCWD, path, X_OK, AT_EACCESS) == 0) return i;
+    }
+    return NO_DIR;
+}
+
+/*
+ * Adds, moves or drops name to match where it now resolves. A desktop entry
+ * of the same name takes over when no executable is left. Names dropped
+ * stay in the pool, only their entry goes away.
+ */
+static bool bins_sync(const char *name)
+{
+    uint16_t dir = on_path(name);
+    if (dir == NO_DIR && find_app(name)) dir = APP_DIR;
+
+    size_t i = bins_lower_bound(&bins, name);
+    if (i < bins.top && strcmp(bin_name(i), name) == 0) {
+        if (dir != NO_DIR) {
+            bins.all[i].dir = dir;
+            return false;
+        }
+        memmove(&bins.all[i], &bins.all[i + 1], (bins.top - i - 1) * sizeof(bin_t));
+        bins.top--;
+        trigrams_invalidate();
+        return true;
+    }
+    if (dir == NO_DIR) return false;
+
+    uint32_t len = strlen(name);
+    bins_reserve(&bins, bins.top + 1);
+    memmove(&bins.all[i + 1], &bins.all[i], (bins.top - i) * sizeof(bin_t));
+    bins.all[i].off = pool_add(&bins, name, len);
+    bins.all[i].len = len;
+    bins.all[i].dir = dir;
+    bins.top++;
+    trigrams_invalidate();
+    return true;
+}
+
+/* Returns true when the bin list changed. */
+bool watch_collect(void)
+{
+    char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t n;
+
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        const struct inotify_event *e;
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + e->len) {
+            e = (const struct inotify_event *)p;
+            if (!e->len) continue;
+
+            bool synced = bins_sync(e->name);
+            if (synced && (e->mask & IN_ATTRIB)) drop_cache();
+            changed |= synced;
+        }
+    }
+    return changed;
+}
+
+/*
+ * levels[k] holds the matches for the first levels[k].qlen characters of
+ * filter_query. Appending to the query can only narrow the result, so a new
+ * level is filtered from the one below it, and editing the query pops back
+ * to the longest level that is still a prefix of it. Levels are filled
+ * lazily: a level that runs out of source items pulls more out of the
+ * level below it, so a broad query costs about as much as the rows asked
+ * for. filter_step() completes and ranks the top level in the background.
+ */
+void filter_reset(void)
+{
+    nlevels = 0;
+    filter_query[0] = '\0';
+    filter_ranked = false;
+    ranked_chunks = 0;
+    boosts_built = false;
+}
+
+static size_t level_source(size_t l)
+{
+    return l ? levels[l - 1].count : bins.top;
+}
+
+static void level_reserve(filter_level_t *level, size_t n)
+{
+    if (level->size < n || !level->items) {
+        level->size = MAX(MAX(n, 2 * level->size), 1);
+        level->items = xrealloc(level->items, level->size * sizeof(uint32_t));
+    }
+}
+
+/* Matches the next n source items of levels[l] on the worker pool, as far as interrupt lets it. */
+static void level_extend(size_t l, size_t n, bool (*interrupt)(void))
+{
+    filter_level_t *level = &levels[l];
+    level_reserve(level, level->count + n);
+
+    job.from = l ? levels[l - 1].items + level->scanned : NULL;
+    job.base = level->scanned;
+    job.items = level->items + level->count;
+    job.n = n;
+    job.q = filter_query;
+    job.k = level->qlen;
+    job.icase = level->icase;
+    size_t nchunks = chunks_reserve(n, 0);
+    size_t run = filter_run(match_chunk, nchunks, interrupt);
+
+    for (size_t c = 0; c < run; ++c) {
+        memmove(level->items + level->count, job.items + c * FILTER_CHUNK, chunk_counts[c] * sizeof(uint32_t));
+        level->count += chunk_counts[c];
+    }
+    level->scanned += MIN(run * FILTER_CHUNK, n);
+
+    if (level->scanned == level_source(l) && (l == 0 || levels[l - 1].complete)) level->complete = true;
+}
+
+/* Extends levels[l] to need matches, or until it is complete or has looked at budget more items. */
+static void level_fill(size_t l, size_t need, size_t *budget)
+{
+    filter_level_t *level = &levels[l];
+
+    while (!level->complete && level->count < need && *budget > 0) {
+        size_t avail = level_source(l);
+        if (level->scanned < avail) {
+            size_t n = MIN(MIN(avail - level->scanned, FILTER_CHUNK), *budget);
+            level_extend(l, n, NULL);
+            *budget -= n;
+        } else if (l > 0 && !levels[l - 1].complete) {
+            level_fill(l - 1, avail + 1, budget);
+        } else {
+            level->complete = true;
+        }
+    }
+}
+
+static void publish(void)
+{
+    const filter_level_t *level = &levels[nlevels - 1];
+    if (!filter_ranked) bins.drawable = level->items;
+    bins.dtop = level->count;
+    bins.dcomplete = level->complete;
+}
+
+/* Ranking needs every match, so only a complete level of at most one chunk is ranked right away. */
+static void rank_eager(void)
+{
+    filter_level_t *level = &levels[nlevels - 1];
+    if (!filter_ranked && level->complete && level->count <= FILTER_CHUNK) {
+        filter_ranked = rank_bins(level, filter_query, level->qlen, NULL);
+    }
+}
+
+/*
+ * q[k] must be the terminating zero, longer queries than levels can hold
+ * are ignored. Lists of up to FILTER_EAGER names are filtered right away,
+ * and ranked too when at most FILTER_CHUNK of them match. Longer ones are
+ * matched until need matches are found or FILTER_EAGER names were looked
+ * at, in their stored order, and filter_step() carries on from there.
+ */
+void filter_bins(const char *q, size_t k, size_t need)
+{
+    if (k >= MAX_INPUT_SIZE) return;
+    if (!filter_fuzzy) trigrams_update();
+
+    size_t common = 0;
+    while (common < k && filter_query[common] == q[common]) common++;
+
+    size_t before = nlevels;
+    while (nlevels > 0 && levels[nlevels - 1].qlen > common) nlevels--;
+    if (nlevels != before) {
+        filter_ranked = false;
+        ranked_chunks = 0;
+    }
+
+    filter_icase = true;
+    for (size_t i = 0; i < k; ++i) {
+        if (isupper((unsigned char)q[i])) filter_icase = false;
+    }
+    memcpy(filter_query, q, k + 1);
+
+    if (nlevels == 0 || levels[nlevels - 1].qlen < k) {
+        const filter_level_t *parent = nlevels ? &levels[nlevels - 1] : NULL;
+        filter_level_t *level = &levels[nlevels++];
+
+        level->qlen = k;
+        level->icase = filter_icase;
+        level->complete = false;
+        level->count = 0;
+        level->scanned = 0;
+        filter_ranked = false;
+        ranked_chunks = 0;
+
+        if (!filter_fuzzy && k >= 3) {
+            size_t limit = parent && parent->complete ? parent->count : bins.top;
+            level_reserve(level, limit);
+            size_t candidates = trigram_candidates(q, k, limit, level->items);
+
+            for (size_t i = 0; candidates != SIZE_MAX && i < candidates; ++i) {
+                uint32_t bin = level->items[i];
+                if (match(bin_name(bin), bins.all[bin].len, q, k)) {
+                    level->items[level->count++] = bin;
+                }
+            }
+            level->complete = candidates != SIZE_MAX;
+        }
+    }
+
+    size_t budget = FILTER_EAGER;
+    if (bins.top <= FILTER_EAGER) {
+        need = SIZE_MAX;
+        budget = SIZE_MAX;
+    }
+    level_fill(nlevels - 1, need, &budget);
+    rank_eager();
+    publish();
+}
+
+/* Called when the cursor moves past the matches found so far. */
+void filter_more(size_t need)
+{
+    if (!nlevels) return;
+
+    size_t budget = FILTER_EAGER;
+    level_fill(nlevels - 1, need, &budget);
+    rank_eager();
+    publish();
+}
+
+bool filter_pending(void)
+{
+    return nlevels && !filter_ranked;
+}
+
+static size_t visible_rows(void)
+{
+    size_t end = MIN(bins.rrange_e, bins.dtop);
+    return end > bins.rrange_s ? end - bins.rrange_s : 0;
+}
+
+/*
+ * One bounded slice of background work: matches the next FILTER_STEP items
+ * of the lowest level the top one still waits for, or ranks the top level
+ * once it is complete. interrupt is polled between chunks and progress made
+ * before it fired is kept. Returns true when the rows in
+ * [bins.rrange_s, bins.rrange_e) changed, the match count aside.
+ */
+bool filter_step(bool (*interrupt)(void))
+{
+    if (!filter_pending()) return false;
+
+    uint32_t rows[FILTER_ROWS];
+    size_t nrows = visible_rows();
+    if (nrows && nrows <= FILTER_ROWS) memcpy(rows, bins.drawable + bins.rrange_s, nrows * sizeof(uint32_t));
+
+    size_t l = nlevels - 1;
+    if (!levels[l].complete) {
+        while (l > 0 && !levels[l - 1].complete) l--;
+        level_extend(l, MIN(level_source(l) - levels[l].scanned, FILTER_STEP), interrupt);
+    } else {
+        filter_ranked = rank_bins(&levels[l], filter_query, levels[l].qlen, interrupt);
+    }
+    publish();
+
+    if (nrows > FILTER_ROWS || visible_rows() != nrows) return true;
+    return nrows && memcmp(rows, bins.drawable + bins.rrange_s, nrows * sizeof(uint32_t)) != 0;
+}
+
+/* Frees the store and resets it, so a new scan may start once the last one is done. */
+void bins_cleanup(void)
+{
+    if (bins.psize) free(bins.pool);
+    free(bins.all);
+    free(bins.set);
+    memset(&bins, 0, sizeof(bins));
+    for (size_t i = 0; i < MAX_INPUT_SIZE; ++i) {
+        free(levels[i].items);
+    }
+    memset(levels, 0, sizeof(levels));
+    filter_reset();
+    free(ranked);
+    ranked = NULL;
+    ranked_size = 0;
+    free(heap);
+    heap = NULL;
+    heap_size = 0;
+    free(chunk_counts);
+    chunk_counts = NULL;
+    chunk_counts_size = 0;
+    free(chunk_heaps);
+    chunk_heaps = NULL;
+    chunk_heaps_size = 0;
+    nhistory = 0;
+    nboosts = 0;
+    trigrams_cleanup();
+    pthread_mutex_lock(&scan_lock);
+    if (scan_done && cache_map) unload_cache();
+    if (scan_done && stdin_map) munmap(stdin_map, stdin_size);
+    stdin_map = NULL;
+    if (scan_done && apps_image) {
+        if (apps_mapped) {
+            munmap(apps_image, apps_image_size);
+        } else {
+            free(apps_image);
+        }
+        apps_image = NULL;
+        apps = NULL;
+        napps = 0;
+    }
+    /* A scan under way still reads its directory paths from path_dirs. */
+    for (size_t i = 0; scan_done && i < npath_dirs; ++i) {
+        free(path_dirs[i]);
+    }
+    if (scan_done) free(path_dirs);
+    path_dirs = NULL;
+    npath_dirs = 0;
+    stdin_mode = false;
+    pthread_mutex_unlock(&scan_lock);
+    if (inotify_fd >= 0) close(inotify_fd);
+    inotify_fd = -1;
+    free(watches);
+    watches = NULL;
+}
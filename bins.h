@@ -0,0 +1,92 @@
+#ifndef BINS_H
+#define BINS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define MAX_INPUT_SIZE 257
+#define POOL_PAD 32
+#define NO_DIR UINT16_MAX
+#define APP_DIR (NO_DIR - 1)
+
+/*
+ * dir is the index of the first PATH directory holding the name, or APP_DIR
+ * for a desktop entry.
+ */
+typedef struct {
+    uint32_t off;
+    uint16_t len;
+    uint16_t dir;
+} bin_t;
+
+/*
+ * all is sorted by name and every name is stored in pool, which is always
+ * followed by POOL_PAD zero bytes. psize is 0 while the pool is borrowed
+ * from the mapped index. drawable[0..dtop) are the matches of the last
+ * filter_bins() found so far, all of them once dcomplete is set, and best
+ * first once filter_pending() returns false. Lines read by stdin_start()
+ * keep their input order and end with '\n' instead of a zero byte, only len
+ * delimits them.
+ */
+typedef struct {
+    char *pool;
+    size_t plen;
+    size_t psize;
+    bin_t *all;
+    size_t top;
+    size_t size;
+    uint32_t *set;
+    size_t set_size;
+    const uint32_t *drawable;
+    size_t dtop;
+    bool dcomplete;
+    size_t cursor;
+    size_t prevcursor;
+    size_t rrange_s;
+    size_t rrange_e;
+} bins_t;
+
+extern bins_t bins;
+extern int scan_pipe[2];
+extern int inotify_fd;
+extern uint64_t scan_begin;
+extern uint64_t scan_end;
+extern bool filter_fuzzy;
+extern size_t filter_keep;
+
+static inline const char *bin_name(uint32_t i)
+{
+    return bins.pool + bins.all[i].off;
+}
+
+void die(const char *msg);
+void *xrealloc(void *p, size_t size);
+uint64_t now_ns(void);
+
+ssize_t bins_find(const char *name);
+const char *bin_dir(uint32_t i);
+const char *bin_exec(uint32_t i, bool *terminal);
+
+void match_init(void);
+size_t match_check(size_t cases);
+void scan_start(void);
+void scan_wait(void);
+void stdin_start(void);
+bool scan_collect(void);
+void watch_start(void);
+bool watch_collect(void);
+void filter_reset(void);
+void history_load(void);
+void history_record(const char *name);
+void filter_bins(const char *q, size_t k, size_t need);
+void filter_more(size_t need);
+bool filter_pending(void);
+bool filter_step(bool (*interrupt)(void));
+void bins_cleanup(void);
+
+#endif
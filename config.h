@@ -4,6 +4,12 @@ const char *fontname = "Adwaita Mono:pixelsize=24";
 
 #define COMPLETIONS_NUMBER 10
 
+/* 1 for fzf-style fuzzy matching, 0 for plain substring matching */
+#define FUZZY_MATCH 0
+
+/* prefix for desktop entries with Terminal=true */
+const char *terminal_command = "xterm -e";
+
 #define TEXT_LENGTH 25
 #define TEXT_OFFSET_X 5
 #define TEXT_OFFSET_Y 5
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <X11/Xlib.h>
+#include <X11/XKBlib.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/Xdamage.h>
+
+#define SETTLE_MS 300
+#define KEY_TIMEOUT_MS 1000
+#define MAP_TIMEOUT_MS 5000
+
+/*
+ * End-to-end latency of arun under Xvfb: every key is injected with XTest
+ * and timed until arun's window reports damage, i.e. until the frame that
+ * answers it has been copied to the window.
+ */
+
+static const char *default_sequences[] = {
+    "firefox", "xterm", "gimp", "python3", "grep", "make", "git", "ls",
+    "systemctl", "pavucontrol", "ssh", "vim", "libreoffice", "htop",
+};
+
+static Display *dpy;
+static Window win;
+static Damage damage;
+static int damage_event;
+static pid_t xvfb_pid = -1;
+static pid_t arun_pid = -1;
+static uint64_t *samples;
+static size_t nsamples;
+static size_t misses;
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "%s", msg);
+    if (arun_pid > 0) kill(arun_pid, SIGTERM);
+    if (xvfb_pid > 0) kill(xvfb_pid, SIGTERM);
+    exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static pid_t spawn(char *const argv[])
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    if (pid < 0) die("Failed to fork\n");
+    return pid;
+}
+
+static void start_xvfb(const char *display)
+{
+    char *argv[] = {"Xvfb", (char *)display, "-screen", "0", "1280x1024x24", "-nolisten", "tcp", NULL};
+    xvfb_pid = spawn(argv);
+
+    for (int i = 0; i < 500 && !dpy; ++i) {
+        usleep(10000);
+        dpy = XOpenDisplay(display);
+    }
+    if (!dpy) die("Failed to connect to Xvfb\n");
+    setenv("DISPLAY", display, 1);
+}
+
+/* Waits up to timeout ms for arun's window to be damaged. */
+static bool wait_damage(int timeout)
+{
+    uint64_t deadline = now_ns() + (uint64_t)timeout * 1000000;
+
+    for (;;) {
+        while (XPending(dpy)) {
+            XEvent e;
+            XNextEvent(dpy, &e);
+            if (e.type == damage_event + XDamageNotify) {
+                XDamageSubtract(dpy, damage, None, None);
+                return true;
+            }
+        }
+
+        uint64_t now = now_ns();
+        if (now >= deadline) return false;
+
+        struct pollfd p = {ConnectionNumber(dpy), POLLIN, 0};
+        poll(&p, 1, (deadline - now) / 1000000 + 1);
+    }
+}
+
+/* Lets arun finish its scan and redraws before the first key goes out. */
+static void settle(void)
+{
+    while (wait_damage(SETTLE_MS));
+}
+
+static void start_arun(const char *arun)
+{
+    XSelectInput(dpy, DefaultRootWindow(dpy), SubstructureNotifyMask);
+    XSync(dpy, False);
+
+    char *argv[] = {(char *)arun, NULL};
+    arun_pid = spawn(argv);
+
+    uint64_t deadline = now_ns() + (uint64_t)MAP_TIMEOUT_MS * 1000000;
+    for (;;) {
+        while (!win && XPending(dpy)) {
+            XEvent e;
+            XNextEvent(dpy, &e);
+            if (e.type == MapNotify) win = e.xmap.window;
+        }
+        if (win) break;
+
+        uint64_t now = now_ns();
+        if (now >= deadline) die("arun did not map a window\n");
+
+        struct pollfd p = {ConnectionNumber(dpy), POLLIN, 0};
+        poll(&p, 1, (deadline - now) / 1000000 + 1);
+    }
+
+    int error_base;
+    if (!XDamageQueryExtension(dpy, &damage_event, &error_base)) die("No DAMAGE extension\n");
+    damage = XDamageCreate(dpy, win, XDamageReportNonEmpty);
+    settle();
+}
+
+static void send_key(KeySym sym, KeySym modifier)
+{
+    KeyCode code = XKeysymToKeycode(dpy, sym);
+    KeyCode mod = modifier ? XKeysymToKeycode(dpy, modifier) : 0;
+    if (!code) return;
+
+    if (!mod && XkbKeycodeToKeysym(dpy, code, 0, 0) != sym) {
+        mod = XKeysymToKeycode(dpy, XK_Shift_L);
+    }
+
+    if (mod) XTestFakeKeyEvent(dpy, mod, True, CurrentTime);
+    XTestFakeKeyEvent(dpy, code, True, CurrentTime);
+    XTestFakeKeyEvent(dpy, code, False, CurrentTime);
+    if (mod) XTestFakeKeyEvent(dpy, mod, False, CurrentTime);
+    XFlush(dpy);
+}
+
+static void time_key(KeySym sym, KeySym modifier)
+{
+    uint64_t start = now_ns();
+    send_key(sym, modifier);
+
+    if (!wait_damage(KEY_TIMEOUT_MS)) {
+        misses++;
+        return;
+    }
+
+    samples = realloc(samples, (nsamples + 1) * sizeof(uint64_t));
+    if (!samples) die("Failed to allocate memory\n");
+    samples[nsamples++] = now_ns() - start;
+}
+
+/* Types seq, backspaces over half of it, types it again and clears the input. */
+static void replay(const char *seq)
+{
+    size_t len = strlen(seq);
+
+    for (size_t i = 0; i < len; ++i) time_key((unsigned char)seq[i], 0);
+    for (size_t i = len / 2; i < len; ++i) time_key(XK_BackSpace, 0);
+    for (size_t i = len / 2; i < len; ++i) time_key((unsigned char)seq[i], 0);
+    time_key(XK_u, XK_Control_L);
+    settle();
+}
+
+static int cmpu64(const void *p1, const void *p2)
+{
+    uint64_t a = *(const uint64_t *)p1;
+    uint64_t b = *(const uint64_t *)p2;
+    return (a > b) - (a < b);
+}
+
+static void report(void)
+{
+    if (nsamples == 0) {
+        printf("no samples, %zu keys without a paint\n", misses);
+        return;
+    }
+
+    qsort(samples, nsamples, sizeof(uint64_t), cmpu64);
+    printf("%zu keys, %zu without a paint\n", nsamples, misses);
+    printf("p50 %.1f us  p99 %.1f us  max %.1f us\n",
+           samples[nsamples / 2] / 1e3, samples[nsamples * 99 / 100] / 1e3, samples[nsamples - 1] / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *display = ":99";
+    const char *arun = "./arun";
+    const char *file = NULL;
+    int rounds = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:f:n:")) != -1) {
+        switch (opt) {
+        case 'd':
+            display = optarg;
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        default:
+            die("usage: arun-latency [-d display] [-f sequences] [-n rounds] [arun]\n");
+        }
+    }
+    if (optind < argc) arun = argv[optind];
+
+    start_xvfb(display);
+
+    int event_base, error_base, major, minor;
+    if (!XTestQueryExtension(dpy, &event_base, &error_base, &major, &minor)) die("No XTEST extension\n");
+
+    start_arun(arun);
+
+    for (int r = 0; r < rounds; ++r) {
+        if (file) {
+            FILE *f = fopen(file, "r");
+            if (!f) die("Failed to open sequence file\n");
+
+            char line[256];
+            while (fgets(line, sizeof(line), f)) {
+                line[strcspn(line, "\n")] = '\0';
+                if (*line) replay(line);
+            }
+            fclose(f);
+        } else {
+            for (size_t i = 0; i < sizeof(default_sequences) / sizeof(default_sequences[0]); ++i) {
+                replay(default_sequences[i]);
+            }
+        }
+    }
+
+    report();
+
+    send_key(XK_Escape, 0);
+    waitpid(arun_pid, NULL, 0);
+    XCloseDisplay(dpy);
+    kill(xvfb_pid, SIGTERM);
+    waitpid(xvfb_pid, NULL, 0);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bins.h"
+#include "prefetch.h"
+
+#define PREFETCH_DELAY_MS 150
+#define PREFETCH_BUDGET (64 * 1024 * 1024)
+#define PREFETCH_FILES 64
+#define PREFETCH_SEEN 512
+#define PREFETCH_SEEN_MS 5000
+#define PREFETCH_NEEDED 64
+
+#if UINTPTR_MAX > 0xffffffffu
+#define ELF_CLASS ELFCLASS64
+typedef Elf64_Ehdr ehdr_t;
+typedef Elf64_Phdr phdr_t;
+typedef Elf64_Dyn dyn_t;
+#else
+#define ELF_CLASS ELFCLASS32
+typedef Elf32_Ehdr ehdr_t;
+typedef Elf32_Phdr phdr_t;
+typedef Elf32_Dyn dyn_t;
+#endif
+
+#if defined(__x86_64__)
+#define MULTIARCH "x86_64-linux-gnu"
+#elif defined(__aarch64__)
+#define MULTIARCH "aarch64-linux-gnu"
+#elif defined(__i386__)
+#define MULTIARCH "i386-linux-gnu"
+#else
+#define MULTIARCH "."
+#endif
+
+/*
+ * Speculative readahead of the highlighted bin. Once the selection has
+ * rested for PREFETCH_DELAY_MS, a background thread reads the executable
+ * and the shared libraries it needs, transitively, into the page cache so
+ * that a launch does not wait for their page-ins. A newer selection
+ * abandons the walk between files. Every walk reads at most PREFETCH_BUDGET
+ * bytes, and files read ahead in the last PREFETCH_SEEN_MS are not read
+ * again. Older ones may have left the page cache since, and readahead() of
+ * cached pages is cheap, so the daemon reads them again on a later walk.
+ */
+
+static const char *lib_dirs[] = {
+    "/lib/" MULTIARCH, "/usr/lib/" MULTIARCH, "/lib64", "/usr/lib64", "/lib", "/usr/lib", "/usr/local/lib",
+};
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    uint64_t at;
+} seen_t;
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond;
+static bool prefetch_started;
+static char prefetch_path[PATH_MAX];
+static uint64_t prefetch_at;
+static uint64_t prefetch_gen;
+
+static seen_t seen[PREFETCH_SEEN];
+static size_t nseen;
+
+static bool superseded(uint64_t gen)
+{
+    pthread_mutex_lock(&prefetch_lock);
+    bool newer = prefetch_gen != gen;
+    pthread_mutex_unlock(&prefetch_lock);
+    return newer;
+}
+
+/* Remembers the last PREFETCH_SEEN files, returns true for one read within PREFETCH_SEEN_MS. */
+static bool mark_seen(const struct stat *st)
+{
+    uint64_t now = now_ns();
+    size_t n = MIN(nseen, PREFETCH_SEEN);
+    for (size_t i = 0; i < n; ++i) {
+        if (seen[i].dev != st->st_dev || seen[i].ino != st->st_ino) continue;
+        if (now - seen[i].at < (uint64_t)PREFETCH_SEEN_MS * 1000000) return true;
+        seen[i].at = now;
+        return false;
+    }
+    seen[nseen++ % PREFETCH_SEEN] = (seen_t){st->st_dev, st->st_ino, now};
+    return false;
+}
+
+static const phdr_t *elf_phdrs(const char *map, size_t size, size_t *n)
+{
+    const ehdr_t *eh = (const ehdr_t *)map;
+    if (size < sizeof(ehdr_t) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh->e_ident[EI_CLASS] != ELF_CLASS || eh->e_phentsize != sizeof(phdr_t) ||
+        eh->e_phoff > size || (size - eh->e_phoff) / sizeof(phdr_t) < eh->e_phnum) {
+        return NULL;
+    }
+    *n = eh->e_phnum;
+    return (const phdr_t *)(map + eh->e_phoff);
+}
+
+/* Maps a virtual address to its file offset through the PT_LOAD segments. */
+static bool elf_offset(const phdr_t *ph, size_t nph, uint64_t addr, uint64_t *off)
+{
+    for (size_t i = 0; i < nph; ++i) {
+        if (ph[i].p_type == PT_LOAD && addr >= ph[i].p_vaddr && addr - ph[i].p_vaddr < ph[i].p_filesz) {
+            *off = addr - ph[i].p_vaddr + ph[i].p_offset;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Opens name in dir, with $ORIGIN standing for origin. */
+static int open_in(const char *dir, const char *name, const char *origin, char *path)
+{
+    int n;
+    if (strncmp(dir, "$ORIGIN", 7) == 0) {
+        n = snprintf(path, PATH_MAX, "%s%s/%s", origin, dir + 7, name);
+    } else if (strchr(dir, '$')) {
+        return -1;
+    } else {
+        n = snprintf(path, PATH_MAX, "%s/%s", dir, name);
+    }
+    if (n < 0 || n >= PATH_MAX) return -1;
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Looks name up as the dynamic loader would, minus ld.so.cache. */
+static bool find_lib(const char *name, const char *runpath, const char *origin, char *path)
+{
+    int fd = -1;
+
+    if (strchr(name, '/')) {
+        if (snprintf(path, PATH_MAX, "%s", name) >= PATH_MAX) return false;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    const char *lists[] = {runpath, getenv("LD_LIBRARY_PATH")};
+    for (size_t l = 0; fd < 0 && !strchr(name, '/') && l < 2; ++l) {
+        if (!lists[l]) continue;
+
+        char *copy = strdup(lists[l]);
+        char *save = NULL;
+        for (char *p = strtok_r(copy, ":", &save); p && fd < 0; p = strtok_r(NULL, ":", &save)) {
+            fd = open_in(p, name, origin, path);
+        }
+        free(copy);
+    }
+
+    for (size_t i = 0; fd < 0 && !strchr(name, '/') && i < sizeof(lib_dirs) / sizeof(lib_dirs[0]); ++i) {
+        fd = open_in(lib_dirs[i], name, origin, path);
+    }
+
+    if (fd < 0) return false;
+    close(fd);
+    return true;
+}
+
+/* Appends the resolved DT_NEEDED entries of the ELF at path to queue. */
+static void add_needed(const char *path, const char *map, size_t size, char (*queue)[PATH_MAX], size_t *nqueue)
+{
+    size_t nph;
+    const phdr_t *ph = elf_phdrs(map, size, &nph);
+    if (!ph) return;
+
+    const dyn_t *dyn = NULL;
+    size_t ndyn = 0;
+    for (size_t i = 0; i < nph; ++i) {
+        if (ph[i].p_type == PT_DYNAMIC && ph[i].p_offset <= size && ph[i].p_filesz <= size - ph[i].p_offset) {
+            dyn = (const dyn_t *)(map + ph[i].p_offset);
+            ndyn = ph[i].p_filesz / sizeof(dyn_t);
+        }
+    }
+
+    uint64_t strtab = 0;
+    uint64_t strsz = 0;
+    uint64_t runpath = UINT64_MAX;
+    uint64_t needed[PREFETCH_NEEDED];
+    size_t nneeded = 0;
+    for (size_t i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; ++i) {
+        switch (dyn[i].d_tag) {
+        case DT_STRTAB: strtab = dyn[i].d_un.d_ptr; break;
+        case DT_STRSZ: strsz = dyn[i].d_un.d_val; break;
+        case DT_RUNPATH: runpath = dyn[i].d_un.d_val; break;
+        case DT_RPATH: if (runpath == UINT64_MAX) runpath = dyn[i].d_un.d_val; break;
+        case DT_NEEDED: if (nneeded < PREFETCH_NEEDED) needed[nneeded++] = dyn[i].d_un.d_val; break;
+        }
+    }
+
+    uint64_t stroff;
+    if (!nneeded || !elf_offset(ph, nph, strtab, &stroff) || stroff > size) return;
+    strsz = MIN(strsz, size - stroff);
+    const char *strings = map + stroff;
+
+    char origin[PATH_MAX];
+    snprintf(origin, sizeof(origin), "%s", path);
+    char *slash = strrchr(origin, '/');
+    if (slash) *slash = '\0';
+
+    const char *rp = runpath < strsz && memchr(strings + runpath, '\0', strsz - runpath) ? strings + runpath : NULL;
+    for (size_t i = 0; i < nneeded && *nqueue < PREFETCH_FILES; ++i) {
+        if (needed[i] >= strsz || !memchr(strings + needed[i], '\0', strsz - needed[i])) continue;
+        if (find_lib(strings + needed[i], rp, origin, queue[*nqueue])) (*nqueue)++;
+    }
+}
+
+/* Walks path and its libraries breadth first until done, out of budget or superseded. */
+static void prefetch_tree(const char *path, uint64_t gen)
+{
+    static char queue[PREFETCH_FILES][PATH_MAX];
+    size_t nqueue = 1;
+    size_t budget = PREFETCH_BUDGET;
+
+    snprintf(queue[0], PATH_MAX, "%s", path);
+    for (size_t i = 0; i < nqueue && budget > 0 && !superseded(gen); ++i) {
+        int fd = open(queue[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || mark_seen(&st)) {
+            close(fd);
+            continue;
+        }
+
+        size_t len = MIN((size_t)st.st_size, budget);
+        readahead(fd, 0, len);
+        budget -= len;
+
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) continue;
+
+        add_needed(queue[i], map, st.st_size, queue, &nqueue);
+        munmap(map, st.st_size);
+    }
+}
+
+static void *prefetch_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&prefetch_lock);
+    for (uint64_t done = 0;;) {
+        if (prefetch_gen == done) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+            continue;
+        }
+
+        uint64_t deadline = prefetch_at + PREFETCH_DELAY_MS * 1000000ull;
+        if (now_ns() < deadline) {
+            struct timespec ts = {deadline / 1000000000u, deadline % 1000000000u};
+            pthread_cond_timedwait(&prefetch_cond, &prefetch_lock, &ts);
+            continue;
+        }
+
+        char path[PATH_MAX];
+        done = prefetch_gen;
+        memcpy(path, prefetch_path, sizeof(path));
+        pthread_mutex_unlock(&prefetch_lock);
+        prefetch_tree(path, done);
+        pthread_mutex_lock(&prefetch_lock);
+    }
+    return NULL;
+}
+
+/* Cheap enough to call on every redraw, only a change of path restarts the delay. */
+void prefetch_request(const char *path)
+{
+    pthread_mutex_lock(&prefetch_lock);
+    if (strcmp(prefetch_path, path) != 0 && strlen(path) < sizeof(prefetch_path)) {
+        strcpy(prefetch_path, path);
+        prefetch_at = now_ns();
+        prefetch_gen++;
+
+        if (!prefetch_started) {
+            pthread_condattr_t attr;
+            pthread_t tid;
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&prefetch_cond, &attr);
+            pthread_condattr_destroy(&attr);
+            if (pthread_create(&tid, NULL, prefetch_thread, NULL) == 0) pthread_detach(tid);
+            prefetch_started = true;
+        }
+        pthread_cond_signal(&prefetch_cond);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+}
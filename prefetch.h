@@ -0,0 +1,6 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+void prefetch_request(const char *path);
+
+#endif